@@ -1,7 +1,16 @@
+import 'package:flutter/foundation.dart';
 import 'package:flutter/material.dart';
 import 'package:flutter/services.dart';
 import 'package:flutter_blue_plus/flutter_blue_plus.dart';
+import 'package:path_provider/path_provider.dart';
+import 'dart:async';
 import 'dart:convert';
+import 'dart:io';
+
+import 'notification_rate.dart';
+import 'preset_engine.dart';
+import 'preset_store.dart';
+import 'scan_selector.dart';
 
 void main() async {
   WidgetsFlutterBinding.ensureInitialized();
@@ -29,7 +38,7 @@ class HomePage extends StatefulWidget {
   _HomePageState createState() => _HomePageState();
 }
 
-class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin {
+class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin, WidgetsBindingObserver {
   // ----------------- BLE -----------------
   BluetoothDevice? esp32Device;
   BluetoothDevice? foundDevice;
@@ -48,23 +57,52 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
   final String SERVICE_UUID = "12345678-1234-5678-1234-56789abcdef0";
   final String CHARACTERISTIC_UUID = "abcd1234-5678-1234-5678-abcdef123456";
   final String SENSOR_CHARACTERISTIC_UUID = "1234abcd-5678-1234-5678-abcdef654321";
+  final String DEVICE_NAME = "ESP32_BLE_Sofa2";
+
+  // ----------------- การสแกน -----------------
+  StreamSubscription<List<ScanResult>>? _scanSubscription;
 
   DateTime lastReconnect = DateTime.fromMillisecondsSinceEpoch(0);
   late AnimationController _controller;
 
+  // ----------------- อัตราการแจ้งเตือน sensor -----------------
+  final NotificationRateController _rateController = NotificationRateController();
+  NotificationRateStats? _loggedRateStats;
+
+  // ----------------- ตำแหน่งปรับเอน -----------------
+  // ตำแหน่งยังไม่ทราบจนกว่าจะโหลดจากไฟล์ได้
+  PresetEngine _presets = PresetEngine();
+  PresetStore? _presetStore;
+  int _cooldownToken = 0;
+  // การเขียน ON ของปุ่มปรับเอนที่กดค้างอยู่
+  Future<bool>? _manualOn;
+
   @override
   void initState() {
     super.initState();
+    WidgetsBinding.instance.addObserver(this);
     scanDevices();
+    _loadPresets();
     _controller = AnimationController(duration: Duration(seconds: 1), vsync: this);
   }
 
   @override
   void dispose() {
+    WidgetsBinding.instance.removeObserver(this);
+    _scanSubscription?.cancel();
     _controller.dispose();
     super.dispose();
   }
 
+  // ----------------- หน้าต่างแสดง/ซ่อน -----------------
+  @override
+  void didChangeAppLifecycleState(AppLifecycleState state) {
+    bool visible = state == AppLifecycleState.resumed || state == AppLifecycleState.inactive;
+    if (_rateController.setVisible(visible)) {
+      _sendRateCommand();
+    }
+  }
+
   // ----------------- สแกนอุปกรณ์ -----------------
   void scanDevices() async {
     setState(() {
@@ -72,33 +110,54 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
       isConnected = false;
     });
 
-    try {
-      await FlutterBluePlus.startScan(timeout: Duration(seconds: 5));
-
-      bool deviceFound = false;
+    // ยกเลิก listener ของการสแกนครั้งก่อน ไม่ให้สะสมทุกครั้งที่เชื่อมต่อใหม่
+    await _scanSubscription?.cancel();
+    _scanSubscription = null;
+
+    bool deviceFound = false;
+    // เลือกโซฟาจาก RSSI ที่ปรับเรียบแล้ว เมื่อแรงกว่าตัวอื่นชัดเจน (ดู scan_selector.dart)
+    ScanSelector<DeviceIdentifier> selector = ScanSelector();
+    Map<DeviceIdentifier, ScanResult> latest = {};
+
+    void choose(ScanResult r) {
+      if (deviceFound) return;
+      deviceFound = true;
+      FlutterBluePlus.stopScan();
+      foundDevice = r.device;
+      connectToDevice(r.device);
+    }
 
-      FlutterBluePlus.scanResults.listen((results) {
+    try {
+      // กรองชื่ออุปกรณ์ตั้งแต่ระดับ platform ผลลัพธ์ที่เข้ามาจึงมีแต่โซฟา
+      _scanSubscription = FlutterBluePlus.onScanResults.listen((results) {
+        if (deviceFound) return;
         for (ScanResult r in results) {
-          if (r.device.name == "ESP32_BLE_Sofa2") {
-            FlutterBluePlus.stopScan();
-            foundDevice = r.device;
-            deviceFound = true;
-            connectToDevice(r.device);
+          DeviceIdentifier id = r.device.remoteId;
+          latest[id] = r;
+          // เลือกทันทีที่มั่นใจ ไม่ต้องรอครบ 5 วินาที
+          if (selector.add(id, r.rssi, r.timeStamp)) {
+            choose(r);
             return;
           }
         }
       });
+      FlutterBluePlus.cancelWhenScanComplete(_scanSubscription!);
 
-      Future.delayed(Duration(seconds: 5), () {
-        if (!deviceFound && mounted) {
-          FlutterBluePlus.stopScan();
-          setState(() {
-            connectionStatus = "ไม่พบอุปกรณ์";
-            isConnected = false;
-          });
-          showStatus("ไม่พบอุปกรณ์ ESP32", Colors.red);
-        }
+      await FlutterBluePlus.startScan(withNames: [DEVICE_NAME], timeout: Duration(seconds: 5));
+      await FlutterBluePlus.isScanning.where((scanning) => !scanning).first;
+
+      if (deviceFound || !mounted) return;
+      DeviceIdentifier? best = selector.best;
+      if (best != null) {
+        // หมดเวลาแต่เคยเห็นโซฟา เลือกตัวที่สัญญาณแรงที่สุด
+        choose(latest[best]!);
+        return;
+      }
+      setState(() {
+        connectionStatus = "ไม่พบอุปกรณ์";
+        isConnected = false;
       });
+      showStatus("ไม่พบอุปกรณ์ ESP32", Colors.red);
     } catch (e) {
       if (!mounted) return;
       setState(() {
@@ -126,25 +185,65 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
         }
       }
     }
+
+    _sendRateCommand();
+  }
+
+  // ----------------- ขออัตราการแจ้งเตือน -----------------
+  // เฟิร์มแวร์ที่ไม่รู้จัก RATE จะไม่สนใจคำสั่งนี้ แอปจึงกรองข้อมูลเองใน _onSensorData
+  // และไม่แจ้งผู้ใช้เมื่อเขียนไม่สำเร็จ
+  // คำสั่งแรกจะรอจนวัดอัตราเดิมของโซฟาได้ครบ baselineWindow ก่อน
+  // (_onSensorData จะส่งให้เองเมื่อวัดเสร็จ) เพื่อใช้เป็นฐานเทียบการประหยัด
+  void _sendRateCommand() async {
+    if (commandCharacteristic == null || !_rateController.commandReady) return;
+    try {
+      await commandCharacteristic!.write(_rateController.command.codeUnits);
+    } catch (_) {}
   }
 
   // ----------------- รับข้อมูล sensor -----------------
   void _onSensorData(List<int> value) {
+    // จับเวลาทั้งฟังก์ชัน รวมการถอดรหัสข้อมูลที่ถูกกรองทิ้ง
+    Stopwatch stopwatch = Stopwatch()..start();
     String data = utf8.decode(value);
     if (data.contains(',')) {
       List<String> sensors = data.split(',');
       if (sensors.length == 3 && mounted) {
-        setState(() {
-          temperature = sensors[0];
-          humidity = sensors[1];
-          mq2Value = sensors[2];
-        });
+        double? t = double.tryParse(sensors[0]);
+        double? h = double.tryParse(sensors[1]);
+        double? p = double.tryParse(sensors[2]);
+        if (t != null && h != null && p != null) {
+          bool accepted = _rateController.accept(SensorReading(t, h, p));
+          if (_rateController.updateMode()) _sendRateCommand();
+          if (accepted) _showSensorValues(sensors);
+          _rateController.recordCpu(stopwatch.elapsed, accepted: accepted);
+          _logRateStats();
+          return;
+        }
+        _showSensorValues(sensors);
       }
     } else if (data.trim().isNotEmpty) {
       _showDialog(data);
     }
   }
 
+  void _showSensorValues(List<String> sensors) {
+    setState(() {
+      temperature = sensors[0];
+      humidity = sensors[1];
+      mq2Value = sensors[2];
+    });
+  }
+
+  // สถิติอ่านได้จาก _rateController.stats และพิมพ์เฉพาะตอน debug
+  void _logRateStats() {
+    if (!kDebugMode) return;
+    NotificationRateStats? stats = _rateController.stats;
+    if (stats == null || identical(stats, _loggedRateStats)) return;
+    _loggedRateStats = stats;
+    debugPrint("Sensor notifications: $stats");
+  }
+
   // ----------------- เชื่อมต่อ -----------------
   void connectToDevice(BluetoothDevice device) async {
     try {
@@ -224,20 +323,25 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
   }
 
   // ----------------- ส่งคำสั่ง -----------------
-  void sendCommand(String command) async {
-    if (commandCharacteristic != null && isConnected) {
+  bool get canSendCommand => commandCharacteristic != null && isConnected;
+
+  // คืนค่า true เมื่อเขียนสำเร็จ ผู้เรียกต้องไม่บันทึกตำแหน่งถ้าเขียนไม่สำเร็จ
+  Future<bool> sendCommand(String command) async {
+    if (canSendCommand) {
       try {
         await commandCharacteristic!.write(command.codeUnits);
+        return true;
       } catch (e) {
-        if (!mounted) return;
+        if (!mounted) return false;
         setState(() => connectionStatus = "ส่งคำสั่งล้มเหลว");
         showStatus("ส่งคำสั่งล้มเหลว", Colors.red);
       }
     } else {
-      if (!mounted) return;
+      if (!mounted) return false;
       setState(() => connectionStatus = "ไม่ได้เชื่อมต่อ");
       showStatus("ไม่ได้เชื่อมต่อ", Colors.red);
     }
+    return false;
   }
 
   // ----------------- SnackBar -----------------
@@ -274,59 +378,186 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
     );
   }
 
-  // ----------------- Cooldown 8 sec -----------------
-  void triggerCooldown() {
-    setState(() => isCooldown = true);
-    Future.delayed(Duration(seconds: 8), () {
-      if (mounted) setState(() => isCooldown = false);
+  // ----------------- Cooldown ตามเวลาที่โซฟาเคลื่อนที่จริง -----------------
+  void triggerCooldown(Duration duration) {
+    int token = ++_cooldownToken;
+    setState(() => isCooldown = duration > Duration.zero);
+    if (duration <= Duration.zero) return;
+    Future.delayed(duration, () {
+      // คำสั่งที่ใหม่กว่าจะกำหนดเวลา cooldown ของตัวเอง
+      if (mounted && token == _cooldownToken) setState(() => isCooldown = false);
     });
   }
 
+  // ----------------- โหลด/บันทึกพรีเซต -----------------
+  void _loadPresets() async {
+    Directory directory;
+    try {
+      directory = await getApplicationSupportDirectory();
+    } catch (_) {
+      return; // ไม่มีที่เก็บไฟล์ ใช้พรีเซตในหน่วยความจำไปก่อน
+    }
+    PresetStore store = PresetStore(File("${directory.path}/presets.json"));
+    PresetEngine presets = await store.load();
+    if (!mounted) return;
+    _presets = presets;
+    _presetStore = store;
+    // โซฟาอาจยังเคลื่อนที่ตามแผนที่ส่งไปก่อนปิดแอป
+    triggerCooldown(presets.remainingMotion);
+  }
+
+  void _savePresets() {
+    _presetStore?.save(_presets);
+  }
+
+  // ----------------- สั่งเคลื่อนที่ตามแผน -----------------
+  // บันทึกตำแหน่งใหม่เมื่อโซฟาได้รับคำสั่งแล้วเท่านั้น ถ้าเขียนล้มเหลวโซฟาอาจได้รับคำสั่ง
+  // หรือไม่ก็ได้ จึงถือว่าไม่ทราบตำแหน่ง
+  void runMotion(MotionPlan plan, String command) async {
+    if (!canSendCommand) {
+      sendCommand(command); // แจ้งผู้ใช้ว่าไม่ได้เชื่อมต่อ
+      return;
+    }
+    // ล็อกปุ่มระหว่างเขียน กันการกดซ้ำ
+    triggerCooldown(plan.estimatedDuration);
+    bool sent = await sendCommand(command);
+    if (sent) {
+      _presets.commit(plan);
+    } else {
+      _presets.forgetPosition();
+    }
+    _savePresets();
+    if (!sent && mounted) triggerCooldown(Duration.zero);
+  }
+
+  // ----------------- ช่องบันทึกเดิมในโซฟา (AUTO1-3) -----------------
+  // ตำแหน่งที่เคยบันทึกด้วย SAVE1-3 อยู่ในโซฟา แอปอ่านค่ากลับมาไม่ได้ จึงนำเข้าเป็นพรีเซต
+  // ไม่ได้ แต่ยังสั่ง AUTO ได้ หลังจากนั้นแอปไม่ทราบตำแหน่ง
+  static const int legacySlots = 3;
+
+  void runLegacySlot(int slot) async {
+    String command = "AUTO$slot";
+    if (!canSendCommand) {
+      sendCommand(command); // แจ้งผู้ใช้ว่าไม่ได้เชื่อมต่อ
+      return;
+    }
+    // ไม่ว่าจะเริ่มจากตรงไหน โซฟาเคลื่อนที่ไม่เกินระยะเต็ม
+    Duration motion = PresetEngine.fullTravel + PresetEngine.settleTime;
+    triggerCooldown(motion);
+    bool sent = await sendCommand(command);
+    _presets.forgetPosition(moving: sent ? motion : Duration.zero);
+    _savePresets();
+    if (!sent && mounted) triggerCooldown(Duration.zero);
+  }
+
   // ----------------- Dialog เลือกพรีเซต -----------------
   void showPresetDialog({required bool isLoad}) {
+    TextEditingController nameController = TextEditingController();
+    List<String> names = _presets.names;
+
     showDialog(
       context: context,
       builder: (context) {
         return AlertDialog(
           shape: RoundedRectangleBorder(borderRadius: BorderRadius.circular(12)),
           title: Text(isLoad ? "เลือกตำแหน่งปรับเอน" : "เลือกตำแหน่งบันทึก"),
-          content: Row(
-            mainAxisAlignment: MainAxisAlignment.spaceEvenly,
-            children: List.generate(3, (index) {
-              int preset = index + 1;
-              return GestureDetector(
-                onTap: () {
-                  Navigator.of(context).pop(); // ปิด Dialog
-                  triggerCooldown();
-                  if (isLoad) {
-                    sendCommand("AUTO$preset");
-                  } else {
-                    sendCommand("SAVE$preset");
-                  }
-                },
-                child: Container(
-                  width: 70,
-                  height: 70,
-                  decoration: BoxDecoration(
-                    color: Colors.blue,
-                    borderRadius: BorderRadius.circular(12),
-                    boxShadow: [BoxShadow(color: Colors.black26, blurRadius: 4)],
+          content: SingleChildScrollView(
+            child: Column(
+              mainAxisSize: MainAxisSize.min,
+              children: [
+                if (isLoad && names.isEmpty) Text("ยังไม่มีตำแหน่งที่บันทึกในแอป", style: TextStyle(fontSize: 18)),
+                Wrap(
+                  spacing: 12,
+                  runSpacing: 12,
+                  alignment: WrapAlignment.center,
+                  children: names.map((name) {
+                    return _presetTile(name, Colors.blue, onTap: () {
+                      Navigator.of(context).pop(); // ปิด Dialog
+                      if (isLoad) {
+                        MotionPlan plan = _presets.planPreset(name)!;
+                        runMotion(plan, plan.command);
+                      } else {
+                        _savePreset(name);
+                      }
+                    });
+                  }).toList(),
+                ),
+                if (isLoad) ...[
+                  SizedBox(height: 16),
+                  Text("ตำแหน่งที่บันทึกไว้ในโซฟา", style: TextStyle(fontSize: 18)),
+                  SizedBox(height: 8),
+                  Wrap(
+                    spacing: 12,
+                    runSpacing: 12,
+                    alignment: WrapAlignment.center,
+                    children: List.generate(legacySlots, (index) {
+                      int slot = index + 1;
+                      return _presetTile("$slot", Colors.blueGrey, onTap: () {
+                        Navigator.of(context).pop(); // ปิด Dialog
+                        runLegacySlot(slot);
+                      });
+                    }),
                   ),
-                  child: Center(
-                    child: Text(
-                      "$preset",
-                      style: TextStyle(fontSize: 28, color: Colors.white, fontWeight: FontWeight.bold),
-                    ),
+                ],
+                if (!isLoad) ...[
+                  SizedBox(height: 16),
+                  TextField(
+                    controller: nameController,
+                    decoration: InputDecoration(labelText: "ชื่อตำแหน่งใหม่"),
                   ),
-                ),
-              );
-            }),
+                ],
+              ],
+            ),
           ),
+          actions: [
+            if (!isLoad)
+              TextButton(
+                child: Text("บันทึก", style: TextStyle(color: Colors.blue)),
+                onPressed: () {
+                  String name = nameController.text.trim();
+                  if (name.isEmpty) return;
+                  Navigator.of(context).pop();
+                  _savePreset(name);
+                },
+              ),
+          ],
         );
       },
+    ).then((_) => nameController.dispose());
+  }
+
+  Widget _presetTile(String label, Color color, {required VoidCallback onTap}) {
+    return GestureDetector(
+      onTap: onTap,
+      child: Container(
+        constraints: BoxConstraints(minWidth: 70),
+        height: 70,
+        padding: EdgeInsets.symmetric(horizontal: 12),
+        decoration: BoxDecoration(
+          color: color,
+          borderRadius: BorderRadius.circular(12),
+          boxShadow: [BoxShadow(color: Colors.black26, blurRadius: 4)],
+        ),
+        child: Center(
+          widthFactor: 1,
+          child: Text(
+            label,
+            style: TextStyle(fontSize: 28, color: Colors.white, fontWeight: FontWeight.bold),
+          ),
+        ),
+      ),
     );
   }
 
+  void _savePreset(String name) {
+    if (!_presets.save(name)) {
+      showStatus("ยังไม่ทราบตำแหน่งโซฟา กด นั่ง หรือ นอน ก่อน", Colors.orange);
+      return;
+    }
+    _savePresets();
+    showStatus("บันทึกตำแหน่ง $name แล้ว", Colors.green);
+  }
+
   // ----------------- UI -----------------
   @override
   Widget build(BuildContext context) {
@@ -401,13 +632,11 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
             mainAxisAlignment: MainAxisAlignment.center,
             children: [
               _circleButton(Icons.chair, onPressed: () {
-                triggerCooldown();
-                sendCommand("Sit");
+                runMotion(_presets.planTo(0), "Sit");
               }),
               SizedBox(width: 80),
               _circleButton(Icons.airline_seat_individual_suite_rounded, onPressed: () {
-                triggerCooldown();
-                sendCommand("Lie");
+                runMotion(_presets.planTo(1), "Lie");
               }),
             ],
           ),
@@ -418,11 +647,11 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
             mainAxisAlignment: MainAxisAlignment.center,
             children: [
               _squareButton("Auto", Icons.upload, onPressed: () {
-                showPresetDialog(isLoad: true); // ใช้ Dialog 3 ช่อง
+                showPresetDialog(isLoad: true);
               }),
               SizedBox(width: 80),
               _squareButton("Save", Icons.save, onPressed: () {
-                showPresetDialog(isLoad: false); // ใช้ Dialog 3 ช่อง
+                showPresetDialog(isLoad: false);
               }),
             ],
           ),
@@ -520,17 +749,46 @@ class _HomePageState extends State<HomePage> with SingleTickerProviderStateMixin
   }
 
   // ----------------- Recliner Button -----------------
+  // เริ่มจับเวลาเมื่อโซฟาได้รับ ON แล้ว และหยุดเมื่อได้รับ OFF แล้ว ถ้าไม่ได้เชื่อมต่อ
+  // โซฟาไม่ขยับ ตำแหน่งจึงไม่เปลี่ยน ถ้าเขียนล้มเหลวถือว่าไม่ทราบตำแหน่ง
+  Future<bool> _startManual(int relayNumber) async {
+    if (!canSendCommand) {
+      sendCommand(relayNumber == 1 ? "ON1" : "ON2"); // แจ้งผู้ใช้ว่าไม่ได้เชื่อมต่อ
+      return false;
+    }
+    bool sent = await sendCommand(relayNumber == 1 ? "ON1" : "ON2");
+    if (sent) {
+      _presets.startManual(relayNumber);
+    } else {
+      _presets.forgetPosition();
+    }
+    _savePresets();
+    return sent;
+  }
+
+  void _stopManual(int relayNumber) async {
+    Future<bool>? on = _manualOn;
+    _manualOn = null;
+    if (on == null) return;
+    // OFF ต้องตามหลัง ON ที่ยังเขียนไม่เสร็จ และส่งเสมอเมื่อเชื่อมต่ออยู่ เผื่อ ON
+    // ไปถึงโซฟาแม้เขียนล้มเหลว
+    bool started = await on;
+    if (!started && !canSendCommand) return;
+    bool stopped = await sendCommand(relayNumber == 1 ? "OFF1" : "OFF2");
+    if (!started) return; // _startManual จัดการตำแหน่งไปแล้ว
+    if (stopped) {
+      _presets.stopManual();
+    } else {
+      _presets.forgetPosition();
+    }
+    _savePresets();
+  }
+
   Widget _reclinerButton(IconData icon, int relayNumber) {
     return GestureDetector(
-      onTapDown: (_) {
-        sendCommand(relayNumber == 1 ? "ON1" : "ON2");
-      },
-      onTapUp: (_) {
-        sendCommand(relayNumber == 1 ? "OFF1" : "OFF2");
-      },
-      onTapCancel: () {
-        sendCommand(relayNumber == 1 ? "OFF1" : "OFF2");
-      },
+      onTapDown: (_) => _manualOn = _startManual(relayNumber),
+      onTapUp: (_) => _stopManual(relayNumber),
+      onTapCancel: () => _stopManual(relayNumber),
       child: ElevatedButton(
         onPressed: () {},
         style: ElevatedButton.styleFrom(
@@ -0,0 +1,329 @@
+// ----------------- Sensor notification rate control -----------------
+//
+// The sofa notifies "temp,humidity,ppm" on the sensor characteristic. The app
+// asks for a rate that matches what the user can see by writing a RATE
+// command to the command characteristic:
+//
+//   RATE:<interval ms>   send a reading at most every <interval ms>
+//   RATE:DELTA           send only when a reading changes noticeably
+//
+// Firmware that does not understand RATE keeps sending at its own pace, so
+// the app also decimates incoming notifications itself.
+//
+// The first RATE command is held back until the sofa's own rate has been
+// measured for [NotificationRateController.baselineWindow]. That measured
+// rate, not an assumed one, is the baseline the savings are reported against.
+
+/// The notification rate the app wants from the sofa.
+enum NotifyRateMode {
+  /// The window is visible and the readings are changing.
+  high,
+
+  /// The app is minimized, hidden or the screen is off.
+  low,
+
+  /// The window is visible but the readings have been stable for a while.
+  deltaOnly,
+}
+
+/// One parsed sensor notification.
+class SensorReading {
+  final double temperature;
+  final double humidity;
+  final double ppm;
+
+  const SensorReading(this.temperature, this.humidity, this.ppm);
+
+  /// Whether any field differs from [other] by more than the delta thresholds.
+  bool differsFrom(SensorReading other) {
+    return (temperature - other.temperature).abs() >= NotificationRateController.temperatureDelta ||
+        (humidity - other.humidity).abs() >= NotificationRateController.humidityDelta ||
+        (ppm - other.ppm).abs() >= NotificationRateController.ppmDelta;
+  }
+}
+
+/// Counters for the last completed minute.
+class NotificationRateStats {
+  final NotifyRateMode mode;
+
+  /// Notifications received from the sofa.
+  final int receivedPerMinute;
+
+  /// Notifications that passed the decimating filter and reached the UI.
+  final int acceptedPerMinute;
+
+  /// Time spent handling notifications, accepted or not.
+  final Duration cpuPerMinute;
+
+  /// Measured mean cost of handling one accepted and one dropped
+  /// notification. Null if none of that kind were timed.
+  final Duration? acceptedCost;
+  final Duration? droppedCost;
+
+  /// Notifications per minute the sofa sent before the first RATE command,
+  /// or null while that is still being measured.
+  final double? baselinePerMinute;
+
+  /// Share of the CPU time saved compared with handling every notification
+  /// at [baselinePerMinute], each at the mean accepted cost measured so far
+  /// this session. Null until the baseline is known and an accepted
+  /// notification has been timed.
+  ///
+  /// The accepted cost stops at setState() and leaves out the rebuild it
+  /// schedules, so this understates the saving.
+  final double? cpuSaving;
+
+  /// Estimated share of the time the radio spent receiving notifications:
+  /// [receivedPerMinute] times
+  /// [NotificationRateController.radioTimePerNotification].
+  final double radioDutyCycle;
+
+  /// Share of that duty cycle saved compared with [baselinePerMinute]. Only
+  /// notifications the sofa actually sends cost radio time, so this is zero
+  /// when the firmware ignores RATE. Null until the baseline is known.
+  final double? radioSaving;
+
+  const NotificationRateStats({
+    required this.mode,
+    required this.receivedPerMinute,
+    required this.acceptedPerMinute,
+    required this.cpuPerMinute,
+    required this.acceptedCost,
+    required this.droppedCost,
+    required this.baselinePerMinute,
+    required this.cpuSaving,
+    required this.radioDutyCycle,
+    required this.radioSaving,
+  });
+
+  static String _percent(double? share, [int digits = 1]) =>
+      share == null ? '-' : '${(share * 100).toStringAsFixed(digits)}%';
+
+  @override
+  String toString() =>
+      'mode=${mode.name} received=$receivedPerMinute/min accepted=$acceptedPerMinute/min '
+      'cpu=${cpuPerMinute.inMicroseconds}us/min '
+      'acceptedCost=${acceptedCost?.inMicroseconds ?? '-'}us droppedCost=${droppedCost?.inMicroseconds ?? '-'}us '
+      'baseline=${baselinePerMinute?.toStringAsFixed(1) ?? '-'}/min cpuSaving=${_percent(cpuSaving)} '
+      'radioDutyCycle=${_percent(radioDutyCycle, 3)} radioSaving=${_percent(radioSaving)}';
+}
+
+/// Chooses the notification rate to request and drops notifications that
+/// arrive faster than that rate.
+class NotificationRateController {
+  static const Duration highInterval = Duration(seconds: 1);
+  static const Duration lowInterval = Duration(seconds: 30);
+
+  /// In delta mode a reading is still let through this often so the UI knows
+  /// the sofa is alive.
+  static const Duration deltaHeartbeat = Duration(seconds: 60);
+
+  /// How long readings must stay within the delta thresholds before a visible
+  /// app switches from [NotifyRateMode.high] to [NotifyRateMode.deltaOnly].
+  static const Duration stableAfter = Duration(seconds: 20);
+
+  static const double temperatureDelta = 0.5;
+  static const double humidityDelta = 1.0;
+  static const double ppmDelta = 25;
+
+  /// Estimated radio on-time of one notification: a connection event carrying
+  /// a short payload, including its acknowledgement.
+  static const Duration radioTimePerNotification = Duration(microseconds: 1500);
+
+  /// How long the sofa's own notification rate is measured before the first
+  /// RATE command may be sent.
+  static const Duration baselineWindow = Duration(seconds: 10);
+
+  final DateTime Function() _now;
+
+  bool _visible = true;
+  NotifyRateMode _mode = NotifyRateMode.high;
+
+  SensorReading? _lastAccepted;
+  DateTime? _lastAcceptedAt;
+  DateTime? _stableSince;
+
+  DateTime _windowStart;
+  int _received = 0;
+  int _accepted = 0;
+  Duration _acceptedCpu = Duration.zero;
+  int _acceptedTimed = 0;
+  Duration _droppedCpu = Duration.zero;
+  int _droppedTimed = 0;
+  NotificationRateStats? _lastStats;
+
+  // Accepted handling cost over the whole session, for the baseline.
+  Duration _sessionAcceptedCpu = Duration.zero;
+  int _sessionAcceptedTimed = 0;
+
+  // The sofa's own rate, measured from the first notification until
+  // [baselineWindow] has passed.
+  DateTime? _baselineStart;
+  int _baselineReceived = 0;
+  double? _baselinePerMinute;
+
+  // Set when the baseline has just been measured, so the held-back command
+  // is reported by the next [updateMode].
+  bool _commandDue = false;
+
+  NotificationRateController({DateTime Function()? now})
+      : _now = now ?? DateTime.now,
+        _windowStart = (now ?? DateTime.now)();
+
+  NotifyRateMode get mode => _mode;
+
+  /// The command that asks the sofa for the current mode's rate.
+  String get command {
+    switch (_mode) {
+      case NotifyRateMode.high:
+        return "RATE:${highInterval.inMilliseconds}";
+      case NotifyRateMode.low:
+        return "RATE:${lowInterval.inMilliseconds}";
+      case NotifyRateMode.deltaOnly:
+        return "RATE:DELTA";
+    }
+  }
+
+  /// Stats for the last completed minute, or null before the first minute.
+  NotificationRateStats? get stats => _lastStats;
+
+  /// Notifications per minute the sofa sent on its own, or null until
+  /// [baselineWindow] of notifications has been seen.
+  double? get baselinePerMinute => _baselinePerMinute;
+
+  /// Whether [command] may be sent. False while the baseline is measured.
+  bool get commandReady => _baselinePerMinute != null;
+
+  /// Records whether the window is visible. Returns true if the mode changed
+  /// and [command] should be sent, which is never before [commandReady].
+  bool setVisible(bool visible) {
+    _visible = visible;
+    _stableSince = null;
+    return _updateMode() && commandReady;
+  }
+
+  /// Decides whether [reading] should reach the UI. Returns true to accept it.
+  ///
+  /// Call [recordCpu] with the time spent handling every notification.
+  bool accept(SensorReading reading) {
+    DateTime now = _now();
+    _rollWindow(now);
+    _received++;
+
+    if (_baselinePerMinute == null) {
+      DateTime start = _baselineStart ??= now;
+      _baselineReceived++;
+      Duration measured = now.difference(start);
+      if (measured >= baselineWindow) {
+        _baselinePerMinute = (_baselineReceived - 1) * Duration.microsecondsPerMinute / measured.inMicroseconds;
+        _commandDue = true;
+      }
+    }
+
+    SensorReading? last = _lastAccepted;
+    bool changed = last == null || reading.differsFrom(last);
+    if (changed) {
+      _stableSince = null;
+    } else {
+      _stableSince ??= _lastAcceptedAt;
+    }
+
+    Duration sinceLast = _lastAcceptedAt == null ? const Duration(days: 1) : now.difference(_lastAcceptedAt!);
+    bool pass;
+    switch (_mode) {
+      case NotifyRateMode.high:
+        pass = sinceLast >= highInterval;
+        break;
+      case NotifyRateMode.low:
+        pass = sinceLast >= lowInterval;
+        break;
+      case NotifyRateMode.deltaOnly:
+        pass = changed || sinceLast >= deltaHeartbeat;
+        break;
+    }
+
+    if (pass) {
+      _lastAccepted = reading;
+      _lastAcceptedAt = now;
+      _accepted++;
+    }
+    return pass;
+  }
+
+  /// Re-evaluates stability after [accept]. Returns true if [command] should
+  /// be sent: the mode changed, or the baseline has just been measured and
+  /// the first command is due.
+  bool updateMode() {
+    bool changed = _updateMode();
+    bool due = _commandDue;
+    _commandDue = false;
+    return (changed || due) && commandReady;
+  }
+
+  /// Records [elapsed] spent handling one notification, from decoding it to
+  /// the end of the handler. [accepted] is what [accept] returned for it.
+  void recordCpu(Duration elapsed, {required bool accepted}) {
+    if (accepted) {
+      _acceptedCpu += elapsed;
+      _acceptedTimed++;
+      _sessionAcceptedCpu += elapsed;
+      _sessionAcceptedTimed++;
+    } else {
+      _droppedCpu += elapsed;
+      _droppedTimed++;
+    }
+  }
+
+  bool _updateMode() {
+    NotifyRateMode next;
+    if (!_visible) {
+      next = NotifyRateMode.low;
+    } else if (_stableSince != null && _now().difference(_stableSince!) >= stableAfter) {
+      next = NotifyRateMode.deltaOnly;
+    } else {
+      next = NotifyRateMode.high;
+    }
+    if (next == _mode) return false;
+    _mode = next;
+    return true;
+  }
+
+  void _rollWindow(DateTime now) {
+    Duration elapsed = now.difference(_windowStart);
+    if (elapsed < const Duration(minutes: 1)) return;
+
+    double minutes = elapsed.inMicroseconds / Duration.microsecondsPerMinute;
+    double receivedRate = _received / minutes;
+    Duration cpu = (_acceptedCpu + _droppedCpu) * (1 / minutes);
+
+    double? baseline = _baselinePerMinute;
+    double? cpuSaving;
+    if (baseline != null && _sessionAcceptedTimed > 0) {
+      double baselineCpuUs = _sessionAcceptedCpu.inMicroseconds / _sessionAcceptedTimed * baseline;
+      if (baselineCpuUs > 0) cpuSaving = 1 - cpu.inMicroseconds / baselineCpuUs;
+    }
+    double radioDutyCycle =
+        receivedRate * radioTimePerNotification.inMicroseconds / Duration.microsecondsPerMinute;
+    double? radioSaving = baseline == null || baseline == 0 ? null : 1 - receivedRate / baseline;
+
+    _lastStats = NotificationRateStats(
+      mode: _mode,
+      receivedPerMinute: receivedRate.round(),
+      acceptedPerMinute: (_accepted / minutes).round(),
+      cpuPerMinute: cpu,
+      acceptedCost: _acceptedTimed == 0 ? null : _acceptedCpu * (1 / _acceptedTimed),
+      droppedCost: _droppedTimed == 0 ? null : _droppedCpu * (1 / _droppedTimed),
+      baselinePerMinute: baseline,
+      cpuSaving: cpuSaving,
+      radioDutyCycle: radioDutyCycle,
+      radioSaving: radioSaving,
+    );
+    _windowStart = now;
+    _received = 0;
+    _accepted = 0;
+    _acceptedCpu = Duration.zero;
+    _acceptedTimed = 0;
+    _droppedCpu = Duration.zero;
+    _droppedTimed = 0;
+  }
+}
@@ -0,0 +1,195 @@
+// ----------------- Preset motion engine -----------------
+//
+// The recliner has one actuator driven by two relays: relay 1 (ON1/OFF1)
+// moves it towards upright and relay 2 (ON2/OFF2) towards flat. The app tracks
+// the recliner position as a fraction of the full travel (0 = upright,
+// 1 = flat) by timing every movement, so a preset can be reached by running
+// each relay for a computed time. The whole plan goes to the sofa as one
+// write:
+//
+//   PLAN:<relay 1 ms>,<relay 2 ms>
+//
+// The sofa runs relay 1 then relay 2 for the given times.
+//
+// Until a movement has reached an end stop the position is unknown, e.g. on
+// first launch, after the app was closed while a button was held, after a
+// write that failed, or after one of the sofa's own AUTO slots. Plans
+// from an unknown position first drive to an end stop, so they take at
+// least the full travel time.
+
+/// A movement computed from the current position to a target position.
+class MotionPlan {
+  final Duration relay1;
+  final Duration relay2;
+  final double targetPosition;
+
+  const MotionPlan(this.relay1, this.relay2, this.targetPosition);
+
+  bool get isEmpty => relay1 == Duration.zero && relay2 == Duration.zero;
+
+  /// When the recliner is expected to have stopped, counted from sending the
+  /// plan.
+  Duration get estimatedDuration =>
+      isEmpty ? Duration.zero : relay1 + relay2 + PresetEngine.settleTime;
+
+  /// The batched write that carries the plan to the sofa.
+  String get command => "PLAN:${relay1.inMilliseconds},${relay2.inMilliseconds}";
+}
+
+/// Stores named recliner positions and plans the movements between them.
+class PresetEngine {
+  /// Time for the actuator to travel from fully upright to flat.
+  static const Duration fullTravel = Duration(seconds: 8);
+
+  /// Allowance for the relay switching and the actuator coming to rest.
+  static const Duration settleTime = Duration(milliseconds: 300);
+
+  /// Extra run time when a plan ends at an end stop. The actuator stops at the
+  /// limit switch, so this is harmless and removes accumulated timing drift.
+  static const Duration endStopOverrun = Duration(milliseconds: 800);
+
+  final DateTime Function() _now;
+
+  double? _position;
+  final Map<String, double> _presets;
+
+  int? _manualRelay;
+  DateTime? _manualStart;
+  DateTime? _movingUntil;
+
+  /// Creates an engine at [position], or at an unknown position if null.
+  PresetEngine({double? position, Map<String, double>? presets, DateTime? movingUntil, DateTime Function()? now})
+      : _position = position?.clamp(0.0, 1.0),
+        _presets = presets ?? {},
+        _movingUntil = movingUntil,
+        _now = now ?? DateTime.now;
+
+  /// The estimated recliner position, 0 = upright, 1 = flat, or null if it is
+  /// unknown.
+  double? get position => _position;
+
+  /// How much longer the last committed plan is expected to keep the
+  /// recliner moving.
+  Duration get remainingMotion {
+    DateTime? until = _movingUntil;
+    if (until == null) return Duration.zero;
+    Duration remaining = until.difference(_now());
+    return remaining > Duration.zero ? remaining : Duration.zero;
+  }
+
+  /// Preset names in alphabetical order.
+  List<String> get names => _presets.keys.toList()..sort();
+
+  double? presetPosition(String name) => _presets[name];
+
+  /// Stores the current position as preset [name], replacing any existing one.
+  /// Returns false, storing nothing, if the position is unknown.
+  bool save(String name) {
+    _stopManualAt(_now());
+    double? position = _position;
+    if (position == null) return false;
+    _presets[name] = position;
+    return true;
+  }
+
+  bool remove(String name) => _presets.remove(name) != null;
+
+  /// Plans the movement to preset [name], or returns null if there is none.
+  MotionPlan? planPreset(String name) {
+    double? target = _presets[name];
+    return target == null ? null : planTo(target);
+  }
+
+  /// Plans the movement from the current position to [target].
+  MotionPlan planTo(double target) {
+    _stopManualAt(_now());
+    target = target.clamp(0.0, 1.0);
+    double? position = _position;
+    if (position == null) {
+      // Find an end stop first: flat if that is the target, otherwise upright
+      // and then out to the target.
+      Duration home = fullTravel + endStopOverrun;
+      return target == 1.0
+          ? MotionPlan(Duration.zero, home, target)
+          : MotionPlan(home, fullTravel * target, target);
+    }
+    double distance = (target - position).abs();
+    if (distance < 0.01) {
+      return MotionPlan(Duration.zero, Duration.zero, target);
+    }
+    Duration run = fullTravel * distance;
+    if (target == 0.0 || target == 1.0) {
+      run += endStopOverrun;
+    }
+    return target < position
+        ? MotionPlan(run, Duration.zero, target)
+        : MotionPlan(Duration.zero, run, target);
+  }
+
+  /// Records that [plan] has been sent to the sofa.
+  void commit(MotionPlan plan) {
+    _position = plan.targetPosition;
+    if (!plan.isEmpty) _movingUntil = _now().add(plan.estimatedDuration);
+  }
+
+  /// Records that the recliner may have moved by an amount the app cannot
+  /// compute: a write that failed after it may have reached the sofa, or one
+  /// of the sofa's own AUTO slots. Any button hold in progress is dropped.
+  /// [moving] is how long the recliner may keep moving.
+  void forgetPosition({Duration moving = Duration.zero}) {
+    _manualRelay = null;
+    _manualStart = null;
+    _position = null;
+    if (moving > Duration.zero) _movingUntil = _now().add(moving);
+  }
+
+  /// Records that the user started holding recliner relay [relay] (1 or 2).
+  void startManual(int relay) {
+    DateTime now = _now();
+    _stopManualAt(now);
+    _manualRelay = relay;
+    _manualStart = now;
+  }
+
+  /// Records that the user released the recliner button.
+  void stopManual() {
+    _stopManualAt(_now());
+  }
+
+  void _stopManualAt(DateTime now) {
+    int? relay = _manualRelay;
+    DateTime? start = _manualStart;
+    if (relay == null || start == null) return;
+    _manualRelay = null;
+    _manualStart = null;
+
+    double moved = now.difference(start).inMicroseconds / fullTravel.inMicroseconds;
+    double? position = _position;
+    if (position == null) {
+      // Holding for the full travel reaches an end stop from anywhere.
+      if (moved >= 1.0) _position = relay == 1 ? 0.0 : 1.0;
+      return;
+    }
+    _position = (relay == 1 ? position - moved : position + moved).clamp(0.0, 1.0);
+  }
+
+  /// The presets, the position and when the last plan should finish. While a
+  /// recliner button is held the position is saved as unknown, since the app
+  /// may not be around to see it released.
+  Map<String, dynamic> toJson() => {
+        "position": _manualRelay == null ? _position : null,
+        "presets": Map<String, double>.from(_presets),
+        if (_movingUntil != null) "movingUntil": _movingUntil!.millisecondsSinceEpoch,
+      };
+
+  factory PresetEngine.fromJson(Map<String, dynamic> json, {DateTime Function()? now}) {
+    Map<String, dynamic> presets = (json["presets"] as Map<String, dynamic>?) ?? {};
+    int? movingUntil = json["movingUntil"] as int?;
+    return PresetEngine(
+      position: (json["position"] as num?)?.toDouble(),
+      presets: presets.map((name, value) => MapEntry(name, (value as num).toDouble())),
+      movingUntil: movingUntil == null ? null : DateTime.fromMillisecondsSinceEpoch(movingUntil),
+      now: now,
+    );
+  }
+}
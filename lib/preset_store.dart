@@ -0,0 +1,51 @@
+// ----------------- Preset storage -----------------
+//
+// The sofa used to keep its three SAVE slots itself. Presets now live in the
+// app, so they and the last recliner position are kept in a JSON file in the
+// app's support directory and survive restarts.
+//
+// The old slots cannot be imported: the sofa has no command that reports
+// their positions. The load dialog still offers them as AUTO1-3, after which
+// the position is unknown.
+
+import 'dart:convert';
+import 'dart:io';
+
+import 'preset_engine.dart';
+
+/// Loads and saves a [PresetEngine] as JSON in [file].
+class PresetStore {
+  final File file;
+
+  Future<void> _lastWrite = Future.value();
+
+  PresetStore(this.file);
+
+  /// Reads the saved engine. Returns an engine with no presets and an unknown
+  /// position if the file is missing or unreadable.
+  Future<PresetEngine> load({DateTime Function()? now}) async {
+    try {
+      Map<String, dynamic> json = jsonDecode(await file.readAsString()) as Map<String, dynamic>;
+      return PresetEngine.fromJson(json, now: now);
+    } catch (_) {
+      return PresetEngine(now: now);
+    }
+  }
+
+  /// Saves the current state of [engine]. Writes go to a temporary file that
+  /// replaces [file], so a crash mid-write keeps the previous contents, and
+  /// run one at a time in the order they were requested. A failed write is
+  /// dropped; the next save writes the whole state again.
+  Future<void> save(PresetEngine engine) {
+    String json = jsonEncode(engine.toJson());
+    _lastWrite = _lastWrite.then((_) => _write(json)).catchError((_) {});
+    return _lastWrite;
+  }
+
+  Future<void> _write(String json) async {
+    await file.parent.create(recursive: true);
+    File temp = File("${file.path}.tmp");
+    await temp.writeAsString(json, flush: true);
+    await temp.rename(file.path);
+  }
+}
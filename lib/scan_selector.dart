@@ -0,0 +1,89 @@
+// ----------------- Sofa selection during a scan -----------------
+//
+// Picks the sofa to connect to out of the scan results, so the scan can stop
+// as soon as the choice is clear instead of after the full timeout. This is
+// the policy of the Linux runner's AdvertisementFilter
+// (linux/runner/scan_filter.cc), minus the name and service matching that the
+// platform scan filter already does: repeat reports inside a short window are
+// dropped, RSSI is exponentially smoothed, and a sofa is only chosen once it
+// has been seen enough times and clearly leads every other sofa in range.
+//
+// The constants below are AdvertisementFilter::Options' defaults in
+// linux/runner/scan_filter.h. Change both together.
+
+/// What the selector knows about one sofa.
+class ScanCandidate<K> {
+  final K id;
+  double smoothedRssi;
+  int sightings = 1;
+  DateTime lastSeen;
+
+  ScanCandidate(this.id, int rssi, this.lastSeen) : smoothedRssi = rssi.toDouble();
+}
+
+/// Chooses between the sofas seen in one scan, identified by [K].
+class ScanSelector<K> {
+  /// Reports from a sofa within this long of its last accepted report are
+  /// dropped as duplicates. flutter_blue_plus also re-delivers earlier
+  /// results in every batch; those fall inside the window too.
+  static const Duration duplicateWindow = Duration(milliseconds: 100);
+
+  /// Weight of each new RSSI reading in the smoothed value.
+  static const double rssiSmoothing = 0.3;
+
+  /// Sofas weaker than this are ignored.
+  static const int minRssi = -95;
+
+  /// A sofa is selected once it has been seen this many times...
+  static const int minSightings = 3;
+
+  /// ...and its smoothed RSSI leads every other sofa by this margin.
+  static const double minMarginDb = 6;
+
+  final Map<K, ScanCandidate<K>> _candidates = {};
+  ScanCandidate<K>? _best;
+  ScanCandidate<K>? _selected;
+
+  /// The selected sofa, or the strongest one so far when nothing has been
+  /// selected yet, e.g. when the scan times out. Null if no sofa was seen.
+  K? get best => (_selected ?? _best)?.id;
+
+  bool get hasSelection => _selected != null;
+
+  /// Processes one report of sofa [id]. Returns true if this report made it
+  /// the confident choice.
+  bool add(K id, int rssi, DateTime time) {
+    if (_selected != null || rssi < minRssi) return false;
+
+    ScanCandidate<K>? candidate = _candidates[id];
+    if (candidate == null) {
+      candidate = ScanCandidate<K>(id, rssi, time);
+      _candidates[id] = candidate;
+    } else {
+      if (time.difference(candidate.lastSeen) < duplicateWindow) return false;
+      candidate.smoothedRssi += rssiSmoothing * (rssi - candidate.smoothedRssi);
+      candidate.sightings++;
+      candidate.lastSeen = time;
+    }
+    return _rank(candidate);
+  }
+
+  bool _rank(ScanCandidate<K> updated) {
+    ScanCandidate<K>? best;
+    ScanCandidate<K>? runnerUp;
+    for (ScanCandidate<K> candidate in _candidates.values) {
+      if (best == null || candidate.smoothedRssi > best.smoothedRssi) {
+        runnerUp = best;
+        best = candidate;
+      } else if (runnerUp == null || candidate.smoothedRssi > runnerUp.smoothedRssi) {
+        runnerUp = candidate;
+      }
+    }
+    _best = best;
+
+    if (!identical(best, updated) || updated.sightings < minSightings) return false;
+    if (runnerUp != null && updated.smoothedRssi - runnerUp.smoothedRssi < minMarginDb) return false;
+    _selected = updated;
+    return true;
+  }
+}
@@ -0,0 +1,568 @@
+#include "async_writer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define RUNNER_HAVE_IO_URING 1
+#endif
+
+#include "sampling_profiler.h"
+
+namespace {
+
+int64_t NowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Returns the smallest power of two that is at least |value|.
+unsigned RoundUpToPowerOfTwo(size_t value) {
+  unsigned result = 1;
+  while (result < value) {
+    result <<= 1;
+  }
+  return result;
+}
+
+}  // namespace
+
+#ifdef RUNNER_HAVE_IO_URING
+
+// A minimal io_uring wrapper over the raw system calls, so the runner does not
+// need liburing. Only the submission thread touches it.
+class AsyncWriter::IoUring {
+ public:
+  IoUring() {}
+
+  ~IoUring() {
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != nullptr) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Creates a ring with at least |entries| submission slots. Returns false if
+  // io_uring is unavailable, e.g. on old kernels or under a seccomp policy.
+  bool Init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0) {
+      return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_ring_size_ > sq_ring_size_) {
+      sq_ring_size_ = cq_ring_size_;
+    }
+
+    sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == nullptr) {
+      return false;
+    }
+    cq_ring_ = single_mmap ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == nullptr) {
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+    if (sqes_ == nullptr) {
+      return false;
+    }
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    cq_entries_ = params.cq_entries;
+    return true;
+  }
+
+  // Registers |count| buffers of |size| bytes starting at |base| so writes
+  // from them skip the per-request page pinning. Returns false if the kernel
+  // refused, e.g. because of RLIMIT_MEMLOCK; unregistered writes still work.
+  bool RegisterBuffers(char* base, size_t size, size_t count) {
+    std::vector<struct iovec> iovecs(count);
+    for (size_t i = 0; i < count; i++) {
+      iovecs[i].iov_base = base + i * size;
+      iovecs[i].iov_len = size;
+    }
+    registered_ = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                          iovecs.data(), static_cast<unsigned>(count)) == 0;
+    return registered_;
+  }
+
+  // Queues a write of |length| bytes at |data| (inside buffer |buffer|) to
+  // |fd| at |offset|. The caller must check sq_space() first.
+  void QueueWrite(int fd, int64_t offset, const char* data, uint32_t length,
+                  uint32_t buffer) {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->off = static_cast<uint64_t>(offset);
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = length;
+    if (registered_) {
+      sqe->buf_index = static_cast<uint16_t>(buffer);
+    }
+    sqe->user_data = buffer;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  // Submits |to_submit| queued writes and, if |wait| is set, blocks until at
+  // least one completion is available. Returns the number submitted or a
+  // negative errno.
+  int Enter(unsigned to_submit, bool wait) {
+    long result = syscall(__NR_io_uring_enter, fd_, to_submit, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    return result < 0 ? -errno : static_cast<int>(result);
+  }
+
+  // Calls |callback| with the buffer index and result of every available
+  // completion.
+  template <typename Callback>
+  void Reap(Callback callback) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      callback(static_cast<uint32_t>(cqe.user_data), cqe.res);
+      head++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  // Number of free submission slots. Entries that Enter() did not submit,
+  // because it failed or the kernel took only some of them, still occupy
+  // theirs until a later Enter() submits them.
+  unsigned sq_space() const {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    return sq_entries_ - (*sq_tail_ - head);
+  }
+
+  // Number of completions the ring can hold; in-flight writes are kept below
+  // this so none are dropped.
+  unsigned cq_entries() const { return cq_entries_; }
+
+ private:
+  void* Map(size_t size, off_t offset) {
+    void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return result == MAP_FAILED ? nullptr : result;
+  }
+
+  int fd_ = -1;
+  bool registered_ = false;
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  unsigned cq_entries_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+};
+
+#else
+
+// Stand-in for platforms without io_uring; Init() always fails so the writer
+// uses the thread pool.
+class AsyncWriter::IoUring {
+ public:
+  bool Init(unsigned entries) { return false; }
+  bool RegisterBuffers(char* base, size_t size, size_t count) { return false; }
+  void QueueWrite(int fd, int64_t offset, const char* data, uint32_t length,
+                  uint32_t buffer) {}
+  int Enter(unsigned to_submit, bool wait) { return -ENOSYS; }
+  template <typename Callback>
+  void Reap(Callback callback) {}
+  unsigned sq_space() const { return 0; }
+  unsigned cq_entries() const { return 0; }
+};
+
+#endif  // RUNNER_HAVE_IO_URING
+
+AsyncWriter::AsyncWriter(const Options& options) : options_(options) {
+  if (options_.buffer_size == 0) {
+    options_.buffer_size = 4096;
+  }
+  if (options_.buffer_count == 0) {
+    options_.buffer_count = 1;
+  }
+  if (options_.batch_size == 0) {
+    options_.batch_size = 1;
+  }
+  if (options_.fallback_threads == 0) {
+    options_.fallback_threads = 1;
+  }
+}
+
+AsyncWriter::~AsyncWriter() { Stop(); }
+
+bool AsyncWriter::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_) {
+    return true;
+  }
+
+  buffers_.reset(new char[options_.buffer_size * options_.buffer_count]);
+  // Anything left from a previous run refers to the old buffers, and to fds
+  // that may since have been closed and reused.
+  pending_.clear();
+  flush_requested_ = false;
+  free_buffers_.clear();
+  for (size_t i = options_.buffer_count; i > 0; i--) {
+    free_buffers_.push_back(static_cast<uint32_t>(i - 1));
+  }
+
+  backend_ = Backend::kThreadPool;
+  if (!options_.force_thread_pool) {
+    std::unique_ptr<IoUring> ring(new IoUring());
+    if (ring->Init(RoundUpToPowerOfTwo(options_.batch_size))) {
+      ring->RegisterBuffers(buffers_.get(), options_.buffer_size,
+                            options_.buffer_count);
+      ring_ = std::move(ring);
+      backend_ = Backend::kIoUring;
+    }
+  }
+
+  running_ = true;
+  stopping_ = false;
+  if (backend_ == Backend::kIoUring) {
+    threads_.emplace_back(&AsyncWriter::IoUringMain, this);
+  } else {
+    for (size_t i = 0; i < options_.fallback_threads; i++) {
+      threads_.emplace_back(&AsyncWriter::ThreadPoolMain, this);
+    }
+  }
+  return true;
+}
+
+void AsyncWriter::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_ || stopping_) {
+      return;
+    }
+    stopping_ = true;
+  }
+  work_ready_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+  ring_.reset();
+
+  // A Write() still copying holds buffers that Start() would otherwise hand
+  // out again; it gives them back and fails once it sees |stopping_|.
+  std::unique_lock<std::mutex> lock(mutex_);
+  copies_done_.wait(lock, [this] { return copying_ == 0; });
+  running_ = false;
+  stopping_ = false;
+}
+
+bool AsyncWriter::Write(int fd, int64_t offset, const void* data,
+                        size_t size) {
+  if (size == 0) {
+    return true;
+  }
+  int64_t queued_ns = NowNs();
+  size_t needed = (size + options_.buffer_size - 1) / options_.buffer_size;
+
+  // Reserve buffers under the lock, but copy into them outside it so the I/O
+  // thread is never held up behind a memcpy.
+  uint32_t reserved[64];
+  std::vector<uint32_t> reserved_overflow;
+  uint32_t* buffers = reserved;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_ || stopping_ || free_buffers_.size() < needed) {
+      rejected_++;
+      return false;
+    }
+    if (needed > sizeof(reserved) / sizeof(reserved[0])) {
+      reserved_overflow.resize(needed);
+      buffers = reserved_overflow.data();
+    }
+    for (size_t i = 0; i < needed; i++) {
+      buffers[i] = free_buffers_.back();
+      free_buffers_.pop_back();
+    }
+    copying_++;
+  }
+
+  const char* in = static_cast<const char*>(data);
+  for (size_t i = 0; i < needed; i++) {
+    size_t start = i * options_.buffer_size;
+    size_t length = size - start < options_.buffer_size ? size - start
+                                                        : options_.buffer_size;
+    memcpy(BufferData(buffers[i]), in + start, length);
+  }
+
+  bool batch_ready;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    copying_--;
+    if (!running_ || stopping_) {
+      // Stop() began during the copy and the I/O threads may have exited, so
+      // nothing queued now would be written.
+      for (size_t i = 0; i < needed; i++) {
+        free_buffers_.push_back(buffers[i]);
+      }
+      rejected_++;
+      if (copying_ == 0) {
+        copies_done_.notify_all();
+      }
+      return false;
+    }
+    size_t queued = pending_.size();
+    for (size_t i = 0; i < needed; i++) {
+      size_t start = i * options_.buffer_size;
+      size_t length = size - start < options_.buffer_size
+                          ? size - start
+                          : options_.buffer_size;
+      pending_.push_back({fd, offset + static_cast<int64_t>(start), buffers[i],
+                          static_cast<uint32_t>(length), 0, queued_ns});
+    }
+    if (pending_.size() > max_queue_depth_) {
+      max_queue_depth_ = pending_.size();
+    }
+    // Only the first write to the queue needs to wake a thread, to start the
+    // |max_delay_us| timer, and then the write that fills half the buffers.
+    size_t high_water = HighWaterMark();
+    batch_ready = queued == 0 ||
+                  (queued < high_water && pending_.size() >= high_water);
+  }
+  if (batch_ready) {
+    work_ready_.notify_one();
+  }
+  return true;
+}
+
+void AsyncWriter::Flush() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty()) {
+      return;
+    }
+    flush_requested_ = true;
+  }
+  work_ready_.notify_one();
+}
+
+AsyncWriter::Stats AsyncWriter::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  stats.queue_depth = pending_.size();
+  stats.max_queue_depth = max_queue_depth_;
+  stats.in_flight = in_flight_;
+  stats.completed = completed_;
+  stats.failed = failed_;
+  stats.rejected = rejected_;
+  stats.batches = batches_;
+  stats.mean_batch_size =
+      batches_ == 0 ? 0 : static_cast<double>(batched_writes_) / batches_;
+  stats.mean_latency_us = latency_.mean_us();
+  stats.p50_latency_us = latency_.Percentile(50);
+  stats.p99_latency_us = latency_.Percentile(99);
+  return stats;
+}
+
+bool AsyncWriter::WaitForBatchLocked(std::unique_lock<std::mutex>* lock) {
+  while (true) {
+    if (pending_.empty()) {
+      if (stopping_) {
+        return false;
+      }
+      work_ready_.wait(*lock);
+      continue;
+    }
+    if (stopping_ || flush_requested_ || pending_.size() >= HighWaterMark()) {
+      return true;
+    }
+    int64_t wait_ns = pending_.front().queued_ns +
+                      options_.max_delay_us * 1000LL - NowNs();
+    if (wait_ns <= 0) {
+      return true;
+    }
+    work_ready_.wait_for(*lock, std::chrono::nanoseconds(wait_ns));
+  }
+}
+
+void AsyncWriter::IoUringMain() {
+  pthread_setname_np(pthread_self(), "runner-writer");
+  ProfilerScope scope("async-writer");
+  std::vector<Request> requests(options_.buffer_count);
+  std::vector<Request> batch;
+  unsigned in_flight = 0;
+  unsigned unsubmitted = 0;
+  unsigned max_in_flight = ring_->cq_entries();
+
+  while (true) {
+    batch.clear();
+    // Only this thread queues to the SQ, so the space can only grow until
+    // the batch below is queued.
+    size_t sq_space = ring_->sq_space();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (in_flight == 0 && !WaitForBatchLocked(&lock)) {
+        return;
+      }
+      while (!pending_.empty() && batch.size() < options_.batch_size &&
+             batch.size() < sq_space &&
+             in_flight + batch.size() < max_in_flight) {
+        batch.push_back(pending_.front());
+        pending_.pop_front();
+      }
+      if (pending_.empty()) {
+        flush_requested_ = false;
+      }
+      if (!batch.empty()) {
+        in_flight_ += batch.size();
+        batches_++;
+        batched_writes_ += batch.size();
+      }
+    }
+
+    for (const Request& request : batch) {
+      requests[request.buffer] = request;
+      ring_->QueueWrite(request.fd, request.offset + request.written,
+                        BufferData(request.buffer) + request.written,
+                        request.size - request.written, request.buffer);
+    }
+    in_flight += batch.size();
+    unsubmitted += batch.size();
+
+    // With nothing new to submit, sleep in the kernel until a write finishes.
+    int result = ring_->Enter(unsubmitted, batch.empty());
+    if (result >= 0) {
+      unsubmitted -= result;
+    }
+
+    int64_t now_ns = NowNs();
+    std::lock_guard<std::mutex> lock(mutex_);
+    ring_->Reap([&](uint32_t buffer, int32_t res) {
+      Request& request = requests[buffer];
+      in_flight--;
+      if (res == -EAGAIN || res == -EINTR) {
+        in_flight_--;
+        pending_.push_front(request);
+        return;
+      }
+      if (res > 0) {
+        request.written += res;
+        if (request.written < request.size) {
+          in_flight_--;
+          pending_.push_front(request);
+          return;
+        }
+      }
+      CompleteLocked(request, res > 0, now_ns);
+    });
+  }
+}
+
+void AsyncWriter::ThreadPoolMain() {
+  pthread_setname_np(pthread_self(), "runner-writer");
+  ProfilerScope scope("async-writer");
+  std::vector<Request> batch;
+  std::vector<bool> results;
+  while (true) {
+    batch.clear();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!WaitForBatchLocked(&lock)) {
+        return;
+      }
+      while (!pending_.empty() && batch.size() < options_.batch_size) {
+        batch.push_back(pending_.front());
+        pending_.pop_front();
+      }
+      if (pending_.empty()) {
+        flush_requested_ = false;
+      }
+      in_flight_ += batch.size();
+      batches_++;
+      batched_writes_ += batch.size();
+    }
+
+    results.assign(batch.size(), true);
+    for (size_t i = 0; i < batch.size(); i++) {
+      Request& request = batch[i];
+      while (request.written < request.size) {
+        ssize_t written =
+            pwrite(request.fd, BufferData(request.buffer) + request.written,
+                   request.size - request.written,
+                   request.offset + request.written);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          results[i] = false;
+          break;
+        }
+        request.written += written;
+      }
+    }
+
+    int64_t now_ns = NowNs();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < batch.size(); i++) {
+      CompleteLocked(batch[i], results[i], now_ns);
+    }
+  }
+}
+
+void AsyncWriter::CompleteLocked(const Request& request, bool success,
+                                 int64_t now_ns) {
+  in_flight_--;
+  free_buffers_.push_back(request.buffer);
+  if (success) {
+    completed_++;
+  } else {
+    failed_++;
+  }
+
+  latency_.Add((now_ns - request.queued_ns) / 1000.0);
+}
@@ -0,0 +1,181 @@
+#ifndef RUNNER_ASYNC_WRITER_H_
+#define RUNNER_ASYNC_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "latency_histogram.h"
+
+// Writes file data off the calling thread so that history, journal and trace
+// output never stalls the GTK main loop.
+//
+// Write() copies the data into one of a fixed set of buffers and returns
+// immediately; it never waits for I/O or for buffer space. On Linux the
+// buffers are registered with an io_uring and flushed in batches from a
+// single submission thread. When io_uring is unavailable a small pool of
+// threads issues pwrite() instead.
+//
+// Writes are coalesced: the I/O thread is only woken once half the buffers
+// are queued, the oldest queued write has waited |max_delay_us|, or Flush()
+// is called. Waking it for every write would cost the caller a context switch
+// per write, which is more than the pwrite() it replaces.
+class AsyncWriter {
+ public:
+  enum class Backend {
+    kIoUring,
+    kThreadPool,
+  };
+
+  struct Options {
+    // Size of each buffer. Larger writes are split across several buffers.
+    size_t buffer_size = 4096;
+
+    // Number of buffers. This bounds the number of writes that can be queued
+    // or in flight; Write() fails once they are all in use.
+    size_t buffer_count = 256;
+
+    // Maximum number of writes submitted to the kernel in one batch.
+    size_t batch_size = 32;
+
+    // Longest a queued write waits for others to batch with before the I/O
+    // thread submits it anyway.
+    uint32_t max_delay_us = 4000;
+
+    // Number of threads used when io_uring is unavailable.
+    size_t fallback_threads = 2;
+
+    // Skips io_uring even when the kernel supports it.
+    bool force_thread_pool = false;
+  };
+
+  struct Stats {
+    // Writes queued but not yet submitted, and the high-water mark.
+    size_t queue_depth = 0;
+    size_t max_queue_depth = 0;
+
+    // Writes submitted to the kernel but not yet completed.
+    size_t in_flight = 0;
+
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+
+    // Writes refused because every buffer was in use.
+    uint64_t rejected = 0;
+
+    // Number of submission batches and the mean writes per batch.
+    uint64_t batches = 0;
+    double mean_batch_size = 0;
+
+    // Time from Write() to completion, in microseconds.
+    double mean_latency_us = 0;
+    double p50_latency_us = 0;
+    double p99_latency_us = 0;
+  };
+
+  explicit AsyncWriter(const Options& options);
+  ~AsyncWriter();
+
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+  // Allocates the buffers and starts the I/O thread(s). Returns true on
+  // success.
+  bool Start();
+
+  // Waits for every queued write to complete and stops the I/O thread(s).
+  // Called automatically on destruction.
+  void Stop();
+
+  // Queues |size| bytes of |data| to be written to |fd| at |offset|. |fd| must
+  // stay open until the write completes. Writes to overlapping ranges may
+  // complete in any order. Returns false, without queuing anything, if the
+  // writer is not running or there is not enough free buffer space.
+  bool Write(int fd, int64_t offset, const void* data, size_t size);
+
+  // Submits the queued writes without waiting for a full batch or
+  // |max_delay_us|, e.g. once a frame's writes are all queued. Does not wait
+  // for them to complete.
+  void Flush();
+
+  Backend backend() const { return backend_; }
+
+  Stats GetStats() const;
+
+ private:
+  class IoUring;
+
+  struct Request {
+    int fd;
+    int64_t offset;
+    uint32_t buffer;
+    uint32_t size;
+
+    // Bytes already written, for resubmitting short writes.
+    uint32_t written;
+
+    int64_t queued_ns;
+  };
+
+  // Body of the io_uring submission thread.
+  void IoUringMain();
+
+  // Body of each fallback thread.
+  void ThreadPoolMain();
+
+  // Blocks until there is a batch worth submitting, as described above.
+  // Returns false once the writer is stopping and nothing is left to write.
+  bool WaitForBatchLocked(std::unique_lock<std::mutex>* lock);
+
+  // Returns |request|'s buffer to the free list and records its latency.
+  // Must be called with |mutex_| held.
+  void CompleteLocked(const Request& request, bool success, int64_t now_ns);
+
+  // Queue depth at which the I/O threads start writing without waiting for
+  // Flush() or |max_delay_us|, well before Write() runs out of buffers.
+  size_t HighWaterMark() const { return (options_.buffer_count + 1) / 2; }
+
+  char* BufferData(uint32_t buffer) const {
+    return buffers_.get() + static_cast<size_t>(buffer) * options_.buffer_size;
+  }
+
+  Options options_;
+  Backend backend_ = Backend::kThreadPool;
+  std::unique_ptr<IoUring> ring_;
+  std::unique_ptr<char[]> buffers_;
+  std::vector<std::thread> threads_;
+
+  // Guards the fields below.
+  mutable std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::deque<Request> pending_;
+  std::vector<uint32_t> free_buffers_;
+  bool running_ = false;
+  bool stopping_ = false;
+
+  // Write() calls that have reserved buffers and are copying into them
+  // outside the lock. Stop() waits on |copies_done_| until there are none.
+  size_t copying_ = 0;
+  std::condition_variable copies_done_;
+
+  // Set by Flush(); cleared once the I/O threads have emptied |pending_|.
+  bool flush_requested_ = false;
+
+  // Statistics.
+  size_t max_queue_depth_ = 0;
+  size_t in_flight_ = 0;
+  uint64_t completed_ = 0;
+  uint64_t failed_ = 0;
+  uint64_t rejected_ = 0;
+  uint64_t batches_ = 0;
+  uint64_t batched_writes_ = 0;
+  LatencyHistogram latency_;
+};
+
+#endif  // RUNNER_ASYNC_WRITER_H_
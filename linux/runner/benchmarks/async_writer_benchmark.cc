@@ -0,0 +1,179 @@
+// Simulates a 60 Hz platform thread that issues history writes at a fixed
+// rate and compares its frame times with no writes, with blocking pwrite()
+// calls, and with AsyncWriter. "async" uses the default Options and never
+// calls Flush(), as the runner does; "async-tuned" sizes the buffers for a
+// few frames of writes and flushes after each frame.
+//
+// Usage: async_writer_benchmark [--rate=WRITES_PER_SECOND] [--seconds=N]
+//                               [--size=BYTES] [--file=PATH]
+//                               [--thread-pool]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_writer.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  int rate = 10000;
+  int seconds = 5;
+  int size = 128;
+  std::string file = "/tmp/sofa_async_writer_benchmark.bin";
+  bool thread_pool = false;
+};
+
+enum class Mode {
+  kNoWrites,
+  kBlocking,
+  kAsync,
+  kAsyncTuned,
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (ParseFlag(argv[i], "--rate", &value)) {
+      options.rate = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--seconds", &value)) {
+      options.seconds = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--size", &value)) {
+      options.size = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--file", &value)) {
+      options.file = value;
+    } else if (strcmp(argv[i], "--thread-pool") == 0) {
+      options.thread_pool = true;
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  return options;
+}
+
+// Stands in for layout and paint work done by the platform thread each frame.
+void SimulateFrameWork() {
+  auto end = Clock::now() + std::chrono::microseconds(2000);
+  volatile uint64_t sink = 0;
+  while (Clock::now() < end) {
+    sink = sink + 1;
+  }
+}
+
+void RunMode(const Options& options, Mode mode, const char* name) {
+  int fd = open(options.file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    perror("open");
+    exit(1);
+  }
+
+  bool async = mode == Mode::kAsync || mode == Mode::kAsyncTuned;
+  AsyncWriter::Options writer_options;
+  writer_options.force_thread_pool = options.thread_pool;
+  if (mode == Mode::kAsyncTuned) {
+    // Room for a few frames of writes, so that a frame's burst stays below
+    // the high-water mark and is written after Flush() rather than during
+    // the frame.
+    writer_options.buffer_count = std::max<size_t>(
+        writer_options.buffer_count, 4 * (options.rate / 60 + 1));
+  }
+  AsyncWriter writer(writer_options);
+  if (async) {
+    writer.Start();
+  }
+
+  const int frames = options.seconds * 60;
+  const auto frame_interval = std::chrono::microseconds(1000000 / 60);
+  std::vector<char> record(options.size, 'x');
+  std::vector<double> frame_ms;
+  frame_ms.reserve(frames);
+  int64_t offset = 0;
+  int64_t writes_due = 0;
+  uint64_t refused = 0;
+
+  auto next_frame = Clock::now();
+  for (int frame = 0; frame < frames; frame++) {
+    auto start = Clock::now();
+    int64_t target = static_cast<int64_t>(options.rate) * (frame + 1) / 60;
+    for (; writes_due < target; writes_due++) {
+      if (mode == Mode::kBlocking) {
+        if (pwrite(fd, record.data(), record.size(), offset) < 0) {
+          perror("pwrite");
+          exit(1);
+        }
+      } else if (async) {
+        if (!writer.Write(fd, offset, record.data(), record.size())) {
+          refused++;
+        }
+      }
+      offset += record.size();
+    }
+    SimulateFrameWork();
+    frame_ms.push_back(
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count());
+    // Hand the frame's writes to the I/O thread once the frame is done, so
+    // they are written while the platform thread is idle.
+    if (mode == Mode::kAsyncTuned) {
+      writer.Flush();
+    }
+    next_frame += frame_interval;
+    std::this_thread::sleep_until(next_frame);
+  }
+
+  AsyncWriter::Stats stats = writer.GetStats();
+  writer.Stop();
+  close(fd);
+
+  std::sort(frame_ms.begin(), frame_ms.end());
+  printf("%-11s frame p50=%.3fms p99=%.3fms max=%.3fms", name,
+         frame_ms[frame_ms.size() / 2], frame_ms[frame_ms.size() * 99 / 100],
+         frame_ms.back());
+  if (async) {
+    printf(" backend=%s completed=%llu refused=%llu max_queue=%zu "
+           "batch=%.1f latency mean=%.0fus p50=%.0fus p99=%.0fus",
+           writer.backend() == AsyncWriter::Backend::kIoUring ? "io_uring"
+                                                               : "threads",
+           static_cast<unsigned long long>(stats.completed),
+           static_cast<unsigned long long>(refused), stats.max_queue_depth,
+           stats.mean_batch_size, stats.mean_latency_us, stats.p50_latency_us,
+           stats.p99_latency_us);
+  }
+  printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  printf("%d writes/s of %d bytes for %ds\n", options.rate, options.size,
+         options.seconds);
+  RunMode(options, Mode::kNoWrites, "no-writes");
+  RunMode(options, Mode::kBlocking, "blocking");
+  RunMode(options, Mode::kAsync, "async");
+  RunMode(options, Mode::kAsyncTuned, "async-tuned");
+  unlink(options.file.c_str());
+  return 0;
+}
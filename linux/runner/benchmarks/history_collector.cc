@@ -0,0 +1,311 @@
+// A stand-in for the history collector, for testing HistorySync locally. It
+// accepts the upload protocol described in history_sync.h, one connection at
+// a time, and appends every chunk to <dir>/<device>.hist.
+//
+// On startup it prints "LISTENING <port>" on stdout. --drop-every=N stores
+// every Nth chunk and then closes the connection without replying, as if the
+// network failed before the acknowledgement arrived.
+//
+// --fault=NAME stores nothing and answers every chunk wrongly:
+//   ack-unchanged       200 naming the chunk's own start
+//   ack-ahead           200 acknowledging one sample more than was sent
+//   conflict-unchanged  409 naming the chunk's own start
+//   conflict-ahead      409 naming a watermark past the client's history
+//
+// Usage: history_collector [--port=N] [--dir=PATH] [--drop-every=N]
+//                          [--fault=NAME]
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "history_sync.h"
+#include "sensor_history.h"
+
+namespace {
+
+struct Options {
+  int port = 0;
+  std::string dir = "/tmp/sofa_history_collector";
+  int drop_every = 0;
+  std::string fault;
+};
+
+struct Device {
+  std::unique_ptr<SensorHistoryWriter> writer;
+  uint64_t total = 0;
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (ParseFlag(argv[i], "--port", &value)) {
+      options.port = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--dir", &value)) {
+      options.dir = value;
+    } else if (ParseFlag(argv[i], "--drop-every", &value)) {
+      options.drop_every = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--fault", &value)) {
+      options.fault = value;
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  return options;
+}
+
+// Returns the value of header |name| in |head|. The match is case sensitive;
+// lower-case both for a case-insensitive lookup.
+std::string HeaderValue(const std::string& head, const std::string& name) {
+  std::string key = "\r\n" + name + ":";
+  size_t start = head.find(key);
+  if (start == std::string::npos) {
+    return std::string();
+  }
+  start += key.size();
+  size_t end = head.find("\r\n", start);
+  std::string value = head.substr(start, end - start);
+  size_t first = value.find_first_not_of(' ');
+  return first == std::string::npos ? std::string() : value.substr(first);
+}
+
+bool SendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t result =
+        send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    sent += result;
+  }
+  return true;
+}
+
+bool Reply(int fd, int status, const char* reason, uint64_t total) {
+  char body[64];
+  snprintf(body, sizeof(body), "ACK %llu %u",
+           static_cast<unsigned long long>(total / kSegmentCapacity),
+           static_cast<unsigned>(total % kSegmentCapacity));
+  char head[256];
+  snprintf(head, sizeof(head),
+           "HTTP/1.1 %d %s\r\n"
+           "Content-Type: text/plain\r\n"
+           "Content-Length: %zu\r\n\r\n",
+           status, reason, strlen(body));
+  return SendAll(fd, std::string(head) + body);
+}
+
+class Collector {
+ public:
+  explicit Collector(const Options& options) : options_(options) {}
+
+  // Serves requests on |fd| until the client closes it.
+  void Serve(int fd) {
+    std::string buffer;
+    char data[64 * 1024];
+    while (true) {
+      size_t head_end = buffer.find("\r\n\r\n");
+      if (head_end == std::string::npos) {
+        ssize_t received = recv(fd, data, sizeof(data), 0);
+        if (received < 0 && errno == EINTR) {
+          continue;
+        }
+        if (received <= 0) {
+          return;
+        }
+        buffer.append(data, received);
+        continue;
+      }
+
+      std::string head = buffer.substr(0, head_end + 2);
+      std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+      size_t length =
+          strtoul(HeaderValue(head, "content-length").c_str(), nullptr, 10);
+      while (buffer.size() < head_end + 4 + length) {
+        ssize_t received = recv(fd, data, sizeof(data), 0);
+        if (received < 0 && errno == EINTR) {
+          continue;
+        }
+        if (received <= 0) {
+          return;
+        }
+        buffer.append(data, received);
+      }
+      std::string body = buffer.substr(head_end + 4, length);
+      // The device id is case sensitive, so take it from the original head.
+      std::string device_id =
+          HeaderValue(buffer.substr(0, head_end + 2), "X-Sofa-Device");
+      buffer.erase(0, head_end + 4 + length);
+
+      if (!Handle(fd, head, device_id, body)) {
+        return;
+      }
+    }
+  }
+
+ private:
+  // Returns false if the connection should be closed.
+  bool Handle(int fd, const std::string& head, const std::string& device_id,
+              const std::string& body) {
+    unsigned long long segment = 0;
+    unsigned int sample = 0;
+    unsigned long count =
+        strtoul(HeaderValue(head, "x-sofa-count").c_str(), nullptr, 10);
+    if (device_id.empty() || device_id.find('/') != std::string::npos ||
+        sscanf(HeaderValue(head, "x-sofa-from").c_str(), "%llu:%u", &segment,
+               &sample) != 2) {
+      Reply(fd, 400, "Bad Request", 0);
+      return false;
+    }
+    Device* device = GetDevice(device_id);
+    if (device == nullptr) {
+      Reply(fd, 500, "Internal Server Error", 0);
+      return false;
+    }
+
+    uint64_t from = segment * kSegmentCapacity + sample;
+    if (!options_.fault.empty()) {
+      return Fault(fd, from, count);
+    }
+    if (from != device->total) {
+      return Reply(fd, 409, "Conflict", device->total);
+    }
+
+    std::string raw(count * kWireSampleSize, '\0');
+    uLongf size = static_cast<uLongf>(raw.size());
+    std::vector<SensorSample> samples;
+    if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &size,
+                   reinterpret_cast<const Bytef*>(body.data()),
+                   body.size()) != Z_OK ||
+        size != raw.size() || !DecodeWireSamples(raw, &samples)) {
+      Reply(fd, 400, "Bad Request", device->total);
+      return false;
+    }
+    for (const SensorSample& value : samples) {
+      if (!device->writer->Append(value)) {
+        Reply(fd, 500, "Internal Server Error", device->total);
+        return false;
+      }
+      device->total++;
+    }
+
+    requests_++;
+    if (options_.drop_every > 0 && requests_ % options_.drop_every == 0) {
+      return false;
+    }
+    return Reply(fd, 200, "OK", device->total);
+  }
+
+  // Answers a chunk of |count| samples starting at |from| as --fault says.
+  bool Fault(int fd, uint64_t from, uint64_t count) {
+    if (options_.fault == "ack-unchanged") {
+      return Reply(fd, 200, "OK", from);
+    }
+    if (options_.fault == "ack-ahead") {
+      return Reply(fd, 200, "OK", from + count + 1);
+    }
+    if (options_.fault == "conflict-unchanged") {
+      return Reply(fd, 409, "Conflict", from);
+    }
+    if (options_.fault == "conflict-ahead") {
+      // Far past any history the benchmark writes.
+      return Reply(fd, 409, "Conflict", from + (1ULL << 32));
+    }
+    Reply(fd, 500, "Internal Server Error", from);
+    return false;
+  }
+
+  Device* GetDevice(const std::string& id) {
+    auto found = devices_.find(id);
+    if (found != devices_.end()) {
+      return &found->second;
+    }
+    std::string path = options_.dir + "/" + id + ".hist";
+    Device device;
+    SensorHistoryReader reader;
+    if (reader.Open(path) && reader.SegmentCount() > 0) {
+      size_t last = reader.SegmentCount() - 1;
+      SegmentSummary summary;
+      if (!reader.ReadSummary(last, &summary)) {
+        return nullptr;
+      }
+      device.total = last * kSegmentCapacity + summary.sample_count;
+    }
+    device.writer.reset(new SensorHistoryWriter());
+    if (!device.writer->Open(path)) {
+      return nullptr;
+    }
+    return &(devices_[id] = std::move(device));
+  }
+
+  Options options_;
+  std::map<std::string, Device> devices_;
+  uint64_t requests_ = 0;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  mkdir(options.dir.c_str(), 0755);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(options.port);
+  socklen_t address_length = sizeof(address);
+  if (bind(listener, reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listener, 8) != 0 ||
+      getsockname(listener, reinterpret_cast<struct sockaddr*>(&address),
+                  &address_length) != 0) {
+    perror("history_collector");
+    return 1;
+  }
+  printf("LISTENING %d\n", ntohs(address.sin_port));
+  fflush(stdout);
+
+  Collector collector(options);
+  while (true) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("history_collector");
+      return 1;
+    }
+    collector.Serve(fd);
+    close(fd);
+  }
+}
@@ -0,0 +1,436 @@
+// Scans a synthetic year of history for 50 sofas with 1..N query threads and
+// reports the speedup over a single thread. Every result is checked against
+// a single-threaded scan of every sample that skips no segments.
+//
+// Usage: history_query_benchmark [--dir=PATH] [--devices=N] [--days=N]
+//                                [--interval-s=N] [--max-threads=N]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "history_query.h"
+#include "sensor_history.h"
+#include "work_stealing_pool.h"
+
+namespace {
+
+constexpr int64_t kDayMs = 24 * 60 * 60 * 1000LL;
+
+// Bumped whenever GenerateDevice() changes, so stale files are not reused.
+constexpr int kDataVersion = 2;
+
+struct Options {
+  std::string dir = "/tmp/sofa_history_benchmark";
+  int devices = 50;
+  int days = 365;
+  int interval_s = 300;
+  int max_threads = 0;
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (ParseFlag(argv[i], "--dir", &value)) {
+      options.dir = value;
+    } else if (ParseFlag(argv[i], "--devices", &value)) {
+      options.devices = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--days", &value)) {
+      options.days = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--interval-s", &value)) {
+      options.interval_s = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--max-threads", &value)) {
+      options.max_threads = atoi(value.c_str());
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (options.max_threads <= 0) {
+    options.max_threads = std::thread::hardware_concurrency();
+  }
+  return options;
+}
+
+std::string DevicePath(const Options& options, int device) {
+  return options.dir + "/sofa_" + std::to_string(device) + "_v" +
+         std::to_string(kDataVersion) + ".hist";
+}
+
+// Writes a daily temperature cycle with noise, slowly drifting humidity and
+// a gas reading that tracks humidity. The gas reading only rises above
+// 1400 ppm on occasional days with poor ventilation, so most segments never
+// reach it and can be skipped from their block statistics.
+bool GenerateDevice(const Options& options, int device) {
+  std::string path = DevicePath(options, device);
+  struct stat info;
+  int64_t samples_per_day = kDayMs / (options.interval_s * 1000LL);
+  int64_t total = samples_per_day * options.days;
+  int64_t expected_size =
+      SegmentOffset((total + kSegmentCapacity - 1) / kSegmentCapacity);
+  if (stat(path.c_str(), &info) == 0 && info.st_size > 0 &&
+      info.st_size <= expected_size &&
+      info.st_size > expected_size - static_cast<int64_t>(kSegmentSize)) {
+    return true;
+  }
+  remove(path.c_str());
+
+  SensorHistoryWriter writer;
+  if (!writer.Open(path)) {
+    return false;
+  }
+  std::mt19937 random(device);
+  std::normal_distribution<float> noise(0.0f, 1.0f);
+  std::uniform_real_distribution<float> spike(0.0f, 1.0f);
+  float humidity = 50.0f;
+  bool stuffy_day = false;
+  for (int64_t i = 0; i < total; i++) {
+    SensorSample sample = {};
+    sample.timestamp_ms = i * options.interval_s * 1000LL;
+    if (i % samples_per_day == 0) {
+      stuffy_day = spike(random) < 1.0f / 60;
+    }
+    double day_phase =
+        static_cast<double>(sample.timestamp_ms % kDayMs) / kDayMs;
+    humidity = fminf(fmaxf(humidity + 0.05f * noise(random), 20.0f), 90.0f);
+    float ppm = 400.0f + 6.0f * humidity + 30.0f * noise(random);
+    if (stuffy_day && spike(random) < 0.5f) {
+      ppm += 1200.0f;
+    }
+    sample.values[kSensorTemperature] = static_cast<float>(
+        24.0 + 6.0 * sin(2 * M_PI * day_phase) + noise(random));
+    sample.values[kSensorHumidity] = humidity;
+    sample.values[kSensorPpm] = ppm;
+    if (!writer.Append(sample)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<HistoryQuery> MakeQueries(int64_t end_ms) {
+  HistoryQuery daily;
+  daily.bucket_ms = kDayMs;
+  daily.end_ms = end_ms;
+  daily.value_field = kSensorTemperature;
+
+  HistoryQuery above_band;
+  above_band.end_ms = end_ms;
+  above_band.value_field = kSensorPpm;
+  above_band.predicates.push_back({kSensorPpm, 1400.0f, INFINITY});
+
+  HistoryQuery correlation;
+  correlation.start_ms = end_ms - 30 * kDayMs;
+  correlation.end_ms = end_ms;
+
+  return {daily, above_band, correlation};
+}
+
+// The statistics of one bucket, computed from every matching value.
+struct Reference {
+  std::vector<float> values;
+  std::vector<float> x;
+  std::vector<float> y;
+  double sum = 0;
+  int64_t duration_ms = 0;
+};
+
+// Computes |query| by reading every sample of every device in order on one
+// thread, without the engine's segment skipping, merging or histograms.
+std::map<int64_t, Reference> ScanAll(const Options& options,
+                                     const HistoryQuery& query) {
+  std::map<int64_t, Reference> buckets;
+  for (int device = 0; device < options.devices; device++) {
+    SensorHistoryReader reader;
+    if (!reader.Open(DevicePath(options, device))) {
+      fprintf(stderr, "Failed to open device %d\n", device);
+      exit(1);
+    }
+    std::vector<SensorSample> all;
+    std::vector<SensorSample> segment;
+    for (size_t i = 0; i < reader.SegmentCount(); i++) {
+      if (!reader.ReadSamples(i, &segment)) {
+        fprintf(stderr, "Failed to read device %d\n", device);
+        exit(1);
+      }
+      all.insert(all.end(), segment.begin(), segment.end());
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+      const SensorSample& sample = all[i];
+      bool match = sample.timestamp_ms >= query.start_ms &&
+                   sample.timestamp_ms < query.end_ms;
+      for (const FieldPredicate& predicate : query.predicates) {
+        float value = sample.values[predicate.field];
+        match = match && value >= predicate.min && value <= predicate.max;
+      }
+      if (!match) {
+        continue;
+      }
+      int64_t gap = 0;
+      if (i + 1 < all.size()) {
+        gap = all[i + 1].timestamp_ms - sample.timestamp_ms;
+      } else if (i > 0) {
+        gap = sample.timestamp_ms - all[i - 1].timestamp_ms;
+      }
+      int64_t bucket = 0;
+      if (query.bucket_ms > 0) {
+        bucket = sample.timestamp_ms / query.bucket_ms * query.bucket_ms;
+      }
+      Reference& reference = buckets[bucket];
+      float value = sample.values[query.value_field];
+      reference.values.push_back(value);
+      reference.x.push_back(sample.values[query.correlation_x]);
+      reference.y.push_back(sample.values[query.correlation_y]);
+      reference.sum += value;
+      reference.duration_ms +=
+          std::min(std::max<int64_t>(gap, 0), query.max_sample_gap_ms);
+    }
+  }
+  for (auto& entry : buckets) {
+    std::sort(entry.second.values.begin(), entry.second.values.end());
+  }
+  return buckets;
+}
+
+// Two-pass Pearson correlation.
+double ExactCorrelation(const std::vector<float>& x,
+                        const std::vector<float>& y) {
+  if (x.size() < 2) {
+    return 0;
+  }
+  double mean_x = 0;
+  double mean_y = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    mean_x += x[i];
+    mean_y += y[i];
+  }
+  mean_x /= x.size();
+  mean_y /= y.size();
+  double covariance = 0;
+  double variance_x = 0;
+  double variance_y = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    covariance += (x[i] - mean_x) * (y[i] - mean_y);
+    variance_x += (x[i] - mean_x) * (x[i] - mean_x);
+    variance_y += (y[i] - mean_y) * (y[i] - mean_y);
+  }
+  if (variance_x <= 0 || variance_y <= 0) {
+    return 0;
+  }
+  return covariance / sqrt(variance_x * variance_y);
+}
+
+// Returns a description of the first difference between |actual| and
+// |expected|, or an empty string if they agree.
+std::string Compare(const HistoryAggregate& actual, const Reference& expected,
+                    float bin_width) {
+  char buffer[160];
+  const std::vector<float>& values = expected.values;
+  if (actual.count() != values.size()) {
+    snprintf(buffer, sizeof(buffer), "count %llu, expected %zu",
+             static_cast<unsigned long long>(actual.count()), values.size());
+    return buffer;
+  }
+  if (values.empty()) {
+    return "";
+  }
+  double mean = expected.sum / values.size();
+  if (actual.min() != values.front() || actual.max() != values.back() ||
+      actual.duration_ms() != expected.duration_ms ||
+      fabs(actual.mean() - mean) > 1e-9 * fmax(1, fabs(mean))) {
+    snprintf(buffer, sizeof(buffer),
+             "min/max/mean/duration %g/%g/%g/%lld, expected %g/%g/%g/%lld",
+             actual.min(), actual.max(), actual.mean(),
+             static_cast<long long>(actual.duration_ms()), values.front(),
+             values.back(), mean,
+             static_cast<long long>(expected.duration_ms));
+    return buffer;
+  }
+  double correlation = ExactCorrelation(expected.x, expected.y);
+  if (fabs(actual.Correlation() - correlation) > 1e-6) {
+    snprintf(buffer, sizeof(buffer), "correlation %.9f, expected %.9f",
+             actual.Correlation(), correlation);
+    return buffer;
+  }
+  // Percentiles need only be accurate to one histogram bin: the value must
+  // lie within a bin width of the samples either side of the rank.
+  for (double p : {0.0, 1.0, 25.0, 50.0, 95.0, 99.9, 100.0}) {
+    double rank = p / 100 * (values.size() - 1);
+    double low = values[static_cast<size_t>(floor(rank))];
+    double high = values[static_cast<size_t>(ceil(rank))];
+    double percentile = actual.Percentile(p);
+    double slack = (p == 0 || p == 100) ? 0 : bin_width * 1.001;
+    if (percentile < low - slack || percentile > high + slack) {
+      snprintf(buffer, sizeof(buffer), "p%g %g, expected %g..%g", p,
+               percentile, low, high);
+      return buffer;
+    }
+  }
+  return "";
+}
+
+// Checks every bucket of |result| against |expected|. Exits on a mismatch.
+void Verify(const HistoryQueryResult& result,
+            const std::map<int64_t, Reference>& expected,
+            const HistoryQuery& query, const char* name, int threads) {
+  float bin_width = query.value_field == kSensorTemperature ? 0.125f
+                    : query.value_field == kSensorHumidity  ? 0.1f
+                                                            : 10.0f;
+  std::string error;
+  if (result.buckets.size() != expected.size()) {
+    error = "bucket count " + std::to_string(result.buckets.size()) +
+            ", expected " + std::to_string(expected.size());
+  }
+  Reference total;
+  for (const auto& entry : expected) {
+    if (!error.empty()) {
+      break;
+    }
+    auto actual = result.buckets.find(entry.first);
+    if (actual == result.buckets.end()) {
+      error = "missing bucket " + std::to_string(entry.first);
+      break;
+    }
+    error = Compare(actual->second, entry.second, bin_width);
+    if (!error.empty()) {
+      error = "bucket " + std::to_string(entry.first) + ": " + error;
+    }
+    const Reference& bucket = entry.second;
+    total.values.insert(total.values.end(), bucket.values.begin(),
+                        bucket.values.end());
+    total.x.insert(total.x.end(), bucket.x.begin(), bucket.x.end());
+    total.y.insert(total.y.end(), bucket.y.begin(), bucket.y.end());
+    total.sum += bucket.sum;
+    total.duration_ms += bucket.duration_ms;
+  }
+  if (error.empty()) {
+    std::sort(total.values.begin(), total.values.end());
+    error = Compare(result.total, total, bin_width);
+    if (!error.empty()) {
+      error = "total: " + error;
+    }
+  }
+  if (!error.empty()) {
+    fprintf(stderr, "MISMATCH in %s query with %d threads: %s\n", name,
+            threads, error.c_str());
+    exit(1);
+  }
+}
+
+double RunQueries(HistoryQueryEngine* engine, int64_t end_ms,
+                  const std::vector<std::map<int64_t, Reference>>* expected,
+                  int threads) {
+  std::vector<HistoryQuery> queries = MakeQueries(end_ms);
+  const HistoryQuery& daily = queries[0];
+  const HistoryQuery& above_band = queries[1];
+  const HistoryQuery& correlation = queries[2];
+
+  auto start = std::chrono::steady_clock::now();
+  HistoryQueryResult daily_result;
+  HistoryQueryResult above_result;
+  HistoryQueryResult correlation_result;
+  if (!engine->Run(daily, &daily_result) ||
+      !engine->Run(above_band, &above_result) ||
+      !engine->Run(correlation, &correlation_result)) {
+    fprintf(stderr, "Query failed\n");
+    exit(1);
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  if (expected != nullptr) {
+    Verify(daily_result, (*expected)[0], daily, "daily", threads);
+    Verify(above_result, (*expected)[1], above_band, "above-band", threads);
+    Verify(correlation_result, (*expected)[2], correlation, "correlation",
+           threads);
+  }
+
+  static bool printed = false;
+  if (!printed) {
+    printed = true;
+    const HistoryAggregate& first_day = daily_result.buckets.begin()->second;
+    printf("day 0 temperature p50=%.2f p95=%.2f over %zu days\n",
+           first_day.Percentile(50), first_day.Percentile(95),
+           daily_result.buckets.size());
+    printf("hours above 1400 ppm: %.1f (segments scanned %zu, skipped %zu)\n",
+           above_result.total.duration_ms() / 3600000.0,
+           above_result.segments_scanned, above_result.segments_skipped);
+    printf("humidity/ppm correlation over 30 days: %.3f "
+           "(segments scanned %zu, skipped %zu)\n",
+           correlation_result.total.Correlation(),
+           correlation_result.segments_scanned,
+           correlation_result.segments_skipped);
+  }
+  return seconds;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  mkdir(options.dir.c_str(), 0755);
+
+  printf("Generating %d devices x %d days at %ds in %s\n", options.devices,
+         options.days, options.interval_s, options.dir.c_str());
+  for (int device = 0; device < options.devices; device++) {
+    if (!GenerateDevice(options, device)) {
+      fprintf(stderr, "Failed to write %s\n",
+              DevicePath(options, device).c_str());
+      return 1;
+    }
+  }
+  int64_t end_ms = options.days * kDayMs;
+
+  std::vector<std::map<int64_t, Reference>> expected;
+  for (const HistoryQuery& query : MakeQueries(end_ms)) {
+    expected.push_back(ScanAll(options, query));
+  }
+
+  // Powers of two, then |max_threads| itself if it is not one.
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < options.max_threads; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(std::max(options.max_threads, 1));
+
+  double baseline = 0;
+  for (int threads : thread_counts) {
+    WorkStealingPool pool(threads);
+    HistoryQueryEngine engine(&pool);
+    for (int device = 0; device < options.devices; device++) {
+      engine.AddDevice(DevicePath(options, device));
+    }
+    // Warm the page cache so every thread count reads from memory, and
+    // check the results against the single-threaded scan.
+    RunQueries(&engine, end_ms, &expected, threads);
+    double seconds = RunQueries(&engine, end_ms, nullptr, threads);
+    if (threads == 1) {
+      baseline = seconds;
+    }
+    printf("threads=%2d time=%.3fs speedup=%.2fx steals=%zu\n", threads,
+           seconds, baseline / seconds, pool.steal_count());
+  }
+  printf("results match a single-threaded scan of every sample\n");
+  return 0;
+}
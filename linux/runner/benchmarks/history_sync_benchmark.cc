@@ -0,0 +1,444 @@
+// Uploads a week of history for 50 sofas that have been offline to the
+// stand-in collector, then measures the delta upload after another hour of
+// readings and a catch-up against a collector that drops acknowledgements.
+//
+// Also checks the wire layout byte for byte, and that a collector answering
+// with a watermark that makes no progress or lies outside the history fails
+// the sync, keeping the saved watermark, instead of looping or reporting it
+// synced. Exits with status 1 if a check fails.
+//
+// Usage: history_sync_benchmark [--dir=PATH] [--collector=PATH]
+//                               [--devices=N] [--days=N] [--interval-s=N]
+//                               [--chunk-samples=N] [--bandwidth=BYTES_PER_S]
+//                               [--drop-every=N]
+
+#include <ftw.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "history_sync.h"
+#include "sensor_history.h"
+
+namespace {
+
+constexpr int64_t kDayMs = 24 * 60 * 60 * 1000LL;
+constexpr int64_t kHourMs = 60 * 60 * 1000LL;
+
+// Marks a directory as created by this benchmark, and so safe to delete.
+constexpr char kMarkerFile[] = ".history_sync_benchmark";
+
+struct Options {
+  std::string dir = "/tmp/sofa_history_sync_benchmark";
+  std::string collector;
+  int devices = 50;
+  int days = 7;
+  int interval_s = 60;
+  uint32_t chunk_samples = 16384;
+  uint64_t bandwidth = 0;
+  int drop_every = 7;
+};
+
+struct Collector {
+  pid_t pid = -1;
+  int port = 0;
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+#ifdef HISTORY_COLLECTOR_PATH
+  options.collector = HISTORY_COLLECTOR_PATH;
+#else
+  std::string self = argv[0];
+  size_t slash = self.rfind('/');
+  options.collector =
+      (slash == std::string::npos ? "." : self.substr(0, slash)) +
+      "/history_collector";
+#endif
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (ParseFlag(argv[i], "--dir", &value)) {
+      options.dir = value;
+    } else if (ParseFlag(argv[i], "--collector", &value)) {
+      options.collector = value;
+    } else if (ParseFlag(argv[i], "--devices", &value)) {
+      options.devices = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--days", &value)) {
+      options.days = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--interval-s", &value)) {
+      options.interval_s = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--chunk-samples", &value)) {
+      options.chunk_samples = strtoul(value.c_str(), nullptr, 10);
+    } else if (ParseFlag(argv[i], "--bandwidth", &value)) {
+      options.bandwidth = strtoull(value.c_str(), nullptr, 10);
+    } else if (ParseFlag(argv[i], "--drop-every", &value)) {
+      options.drop_every = atoi(value.c_str());
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  return options;
+}
+
+int RemoveEntry(const char* path, const struct stat* info, int type,
+                struct FTW* ftw) {
+  return remove(path);
+}
+
+// Creates an empty |dir|. An existing |dir| is only deleted if an earlier run
+// created it, so a mistyped --dir cannot wipe anything else.
+bool PrepareDirectory(const std::string& dir) {
+  struct stat info;
+  if (stat(dir.c_str(), &info) == 0) {
+    if (access((dir + "/" + kMarkerFile).c_str(), F_OK) != 0) {
+      fprintf(stderr, "%s exists and was not created by this benchmark\n",
+              dir.c_str());
+      return false;
+    }
+    if (nftw(dir.c_str(), &RemoveEntry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+      fprintf(stderr, "Could not remove %s\n", dir.c_str());
+      return false;
+    }
+  }
+  FILE* marker = nullptr;
+  if (mkdir(dir.c_str(), 0755) != 0 ||
+      (marker = fopen((dir + "/" + kMarkerFile).c_str(), "w")) == nullptr) {
+    fprintf(stderr, "Could not create %s\n", dir.c_str());
+    return false;
+  }
+  fclose(marker);
+  return true;
+}
+
+std::string DeviceId(int device) { return "sofa_" + std::to_string(device); }
+
+std::string DevicePath(const Options& options, int device) {
+  return options.dir + "/client/" + DeviceId(device) + ".hist";
+}
+
+// Appends readings from |start_ms| to |end_ms|: a daily temperature cycle, a
+// drifting humidity and a gas reading that follows it, rounded to the sensor's
+// resolution.
+bool AppendReadings(const Options& options, int device, int64_t start_ms,
+                    int64_t end_ms) {
+  SensorHistoryWriter writer;
+  if (!writer.Open(DevicePath(options, device))) {
+    return false;
+  }
+  std::mt19937 random(device * 7919 + start_ms / kHourMs);
+  std::normal_distribution<float> noise(0.0f, 1.0f);
+  float humidity = 50.0f;
+  for (int64_t t = start_ms; t < end_ms; t += options.interval_s * 1000LL) {
+    SensorSample sample = {};
+    sample.timestamp_ms = t;
+    double day_phase = static_cast<double>(t % kDayMs) / kDayMs;
+    humidity = fminf(fmaxf(humidity + 0.05f * noise(random), 20.0f), 90.0f);
+    sample.values[kSensorTemperature] = roundf(static_cast<float>(
+        10 * (24.0 + 6.0 * sin(2 * M_PI * day_phase) + 0.3 * noise(random))));
+    sample.values[kSensorTemperature] /= 10;
+    sample.values[kSensorHumidity] = roundf(humidity);
+    sample.values[kSensorPpm] =
+        roundf(400.0f + 10.0f * humidity + 20.0f * noise(random));
+    if (!writer.Append(sample)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Starts the collector storing into |dir|. |fault| is its --fault mode, or
+// empty for a well-behaved collector.
+bool StartCollector(const Options& options, const std::string& dir,
+                    int drop_every, const std::string& fault,
+                    Collector* collector) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    std::string dir_flag = "--dir=" + dir;
+    std::string drop_flag = "--drop-every=" + std::to_string(drop_every);
+    std::string fault_flag = "--fault=" + fault;
+    execl(options.collector.c_str(), options.collector.c_str(),
+          dir_flag.c_str(), drop_flag.c_str(),
+          fault.empty() ? static_cast<char*>(nullptr) : fault_flag.c_str(),
+          static_cast<char*>(nullptr));
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+  FILE* output = fdopen(pipe_fds[0], "r");
+  int port = 0;
+  bool started = pid > 0 && output != nullptr &&
+                 fscanf(output, "LISTENING %d", &port) == 1;
+  if (output != nullptr) {
+    fclose(output);
+  }
+  if (!started) {
+    fprintf(stderr, "Could not start %s\n", options.collector.c_str());
+    return false;
+  }
+  collector->pid = pid;
+  collector->port = port;
+  return true;
+}
+
+void StopCollector(Collector* collector) {
+  if (collector->pid > 0) {
+    kill(collector->pid, SIGTERM);
+    waitpid(collector->pid, nullptr, 0);
+    collector->pid = -1;
+  }
+}
+
+HistorySync::Options SyncOptions(const Options& options,
+                                 const Collector& collector,
+                                 const std::string& state_path) {
+  HistorySync::Options sync_options;
+  sync_options.endpoint =
+      "http://127.0.0.1:" + std::to_string(collector.port) + "/ingest";
+  sync_options.state_path = state_path;
+  sync_options.chunk_samples = options.chunk_samples;
+  sync_options.max_bytes_per_second = options.bandwidth;
+  return sync_options;
+}
+
+void AddDevices(const Options& options, HistorySync* sync) {
+  for (int i = 0; i < options.devices; i++) {
+    sync->AddDevice(DeviceId(i), DevicePath(options, i));
+  }
+}
+
+void PrintStats(const char* label, const HistorySync::Stats& stats,
+                bool synced) {
+  printf("%-11s %s: %llu samples in %llu chunks, %.2f MB raw -> %.2f MB sent "
+         "(%.1fx), %.0f bytes/device-day, %.2f s, %.0f device-days/s, "
+         "%llu retries, %llu resyncs\n",
+         label, synced ? "synced" : "FAILED",
+         static_cast<unsigned long long>(stats.samples),
+         static_cast<unsigned long long>(stats.chunks), stats.raw_bytes / 1e6,
+         stats.sent_bytes / 1e6,
+         stats.sent_bytes ? static_cast<double>(stats.raw_bytes) /
+                                stats.sent_bytes
+                          : 0.0,
+         stats.bytes_per_device_day(), stats.seconds,
+         stats.seconds > 0 ? stats.device_days / stats.seconds : 0.0,
+         static_cast<unsigned long long>(stats.retries),
+         static_cast<unsigned long long>(stats.resyncs));
+}
+
+// Returns true if the collector's copy of every device matches the client's.
+bool Verify(const Options& options, const std::string& collector_dir) {
+  for (int i = 0; i < options.devices; i++) {
+    SensorHistoryReader client;
+    SensorHistoryReader server;
+    if (!client.Open(DevicePath(options, i)) ||
+        !server.Open(collector_dir + "/" + DeviceId(i) + ".hist") ||
+        client.SegmentCount() != server.SegmentCount()) {
+      return false;
+    }
+    std::vector<SensorSample> expected;
+    std::vector<SensorSample> actual;
+    for (size_t segment = 0; segment < client.SegmentCount(); segment++) {
+      if (!client.ReadSamples(segment, &expected) ||
+          !server.ReadSamples(segment, &actual) ||
+          expected.size() != actual.size() ||
+          memcmp(expected.data(), actual.data(),
+                 expected.size() * sizeof(SensorSample)) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s\n", what);
+    exit(1);
+  }
+}
+
+void CheckWireLayout() {
+  SensorSample sample = {};
+  sample.timestamp_ms = 0x0102030405060708LL;
+  sample.values[0] = 1.0f;
+  sample.values[1] = -2.5f;
+  sample.values[2] = 0.0f;
+  sample.reserved = 0xffffffff;
+  const unsigned char expected[] = {
+      0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,  // timestamp_ms
+      0x00, 0x00, 0x80, 0x3f,                          // 1.0f
+      0x00, 0x00, 0x20, 0xc0,                          // -2.5f
+      0x00, 0x00, 0x00, 0x00,                          // 0.0f
+  };
+  static_assert(sizeof(expected) == kWireSampleSize, "update |expected|");
+
+  std::string wire;
+  EncodeWireSamples(&sample, 1, &wire);
+  Check(wire.size() == sizeof(expected) &&
+            memcmp(wire.data(), expected, sizeof(expected)) == 0,
+        "samples are encoded little-endian without the reserved field");
+  std::vector<SensorSample> decoded;
+  Check(DecodeWireSamples(wire, &decoded) && decoded.size() == 1 &&
+            decoded[0].timestamp_ms == sample.timestamp_ms &&
+            memcmp(decoded[0].values, sample.values, sizeof(sample.values)) ==
+                0 &&
+            decoded[0].reserved == 0,
+        "decoding restores the sample");
+  Check(!DecodeWireSamples(wire.substr(1), &decoded),
+        "a partial sample is rejected");
+  printf("wire layout: %zu bytes per sample, ok\n", kWireSampleSize);
+}
+
+// Syncs the first device against a collector running each --fault mode. The
+// sync must fail without moving the saved watermark. A hang is caught by the
+// alarm in main().
+void CheckFaults(const Options& options) {
+  const char* faults[] = {"ack-unchanged", "ack-ahead", "conflict-unchanged",
+                          "conflict-ahead"};
+  for (const char* fault : faults) {
+    std::string state_path = options.dir + "/faulty.state";
+    remove(state_path.c_str());
+    Collector collector;
+    Check(StartCollector(options, options.dir + "/faulty", 0, fault,
+                         &collector),
+          "the collector starts");
+    HistorySync sync(SyncOptions(options, collector, state_path));
+    sync.AddDevice(DeviceId(0), DevicePath(options, 0));
+    bool synced = sync.Sync();
+    StopCollector(&collector);
+    SyncWatermark watermark = sync.GetWatermark(DeviceId(0));
+    printf("fault %-18s %s after %llu chunks and %llu resyncs\n", fault,
+           synced ? "SYNCED" : "failed",
+           static_cast<unsigned long long>(sync.stats().chunks),
+           static_cast<unsigned long long>(sync.stats().resyncs));
+    Check(!synced, "a faulty collector fails the sync");
+    Check(watermark.segment == 0 && watermark.sample == 0,
+          "a faulty reply does not move the saved watermark");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  CheckWireLayout();
+  if (!PrepareDirectory(options.dir)) {
+    return 1;
+  }
+  if (mkdir((options.dir + "/client").c_str(), 0755) != 0) {
+    fprintf(stderr, "Could not create %s/client\n", options.dir.c_str());
+    return 1;
+  }
+
+  int64_t week_ms = options.days * kDayMs;
+  for (int i = 0; i < options.devices; i++) {
+    if (!AppendReadings(options, i, 0, week_ms)) {
+      fprintf(stderr, "Could not write %s\n", DevicePath(options, i).c_str());
+      return 1;
+    }
+  }
+  std::string bandwidth = options.bandwidth
+                              ? std::to_string(options.bandwidth) + " B/s"
+                              : std::string("unlimited");
+  printf("%d devices, %d days offline at one reading per %d s, "
+         "%u samples per chunk, bandwidth %s\n",
+         options.devices, options.days, options.interval_s,
+         options.chunk_samples, bandwidth.c_str());
+
+  alarm(60);
+  CheckFaults(options);
+  alarm(0);
+
+  // Catch up after being offline, then upload one more hour.
+  Collector collector;
+  if (!StartCollector(options, options.dir + "/collector", 0, "",
+                      &collector)) {
+    return 1;
+  }
+  std::string state_path = options.dir + "/sync.state";
+  {
+    HistorySync sync(SyncOptions(options, collector, state_path));
+    AddDevices(options, &sync);
+    bool synced = sync.Sync();
+    PrintStats("catch-up", sync.stats(), synced);
+  }
+  for (int i = 0; i < options.devices; i++) {
+    AppendReadings(options, i, week_ms, week_ms + kHourMs);
+  }
+  {
+    HistorySync sync(SyncOptions(options, collector, state_path));
+    AddDevices(options, &sync);
+    bool synced = sync.Sync();
+    PrintStats("delta", sync.stats(), synced);
+  }
+  {
+    HistorySync sync(SyncOptions(options, collector, state_path));
+    AddDevices(options, &sync);
+    bool synced = sync.Sync();
+    PrintStats("no change", sync.stats(), synced);
+  }
+  StopCollector(&collector);
+  printf("collector copy %s\n",
+         Verify(options, options.dir + "/collector") ? "matches" : "DIFFERS");
+
+  // Catch up against a collector that loses every Nth acknowledgement and is
+  // restarted after the first half of the devices, resuming from the saved
+  // state.
+  if (options.drop_every > 0) {
+    std::string lossy_dir = options.dir + "/lossy";
+    std::string lossy_state = options.dir + "/lossy.state";
+    if (!StartCollector(options, lossy_dir, options.drop_every, "",
+                        &collector)) {
+      return 1;
+    }
+    HistorySync::Stats interrupted;
+    bool half_synced;
+    {
+      HistorySync sync(SyncOptions(options, collector, lossy_state));
+      for (int i = 0; i < options.devices / 2; i++) {
+        sync.AddDevice(DeviceId(i), DevicePath(options, i));
+      }
+      half_synced = sync.Sync();
+      interrupted = sync.stats();
+    }
+    StopCollector(&collector);
+
+    if (!StartCollector(options, lossy_dir, options.drop_every, "",
+                        &collector)) {
+      return 1;
+    }
+    HistorySync sync(SyncOptions(options, collector, lossy_state));
+    AddDevices(options, &sync);
+    bool synced = sync.Sync();
+    StopCollector(&collector);
+    PrintStats("lossy 1/2", interrupted, half_synced);
+    PrintStats("lossy 2/2", sync.stats(), synced);
+    printf("collector copy %s\n",
+           Verify(options, lossy_dir) ? "matches" : "DIFFERS");
+  }
+  return 0;
+}
@@ -0,0 +1,177 @@
+// Runs a fixed CPU-bound workload with and without SamplingProfiler and
+// reports the slowdown, then writes the profile in folded-stack format.
+//
+// Usage: sampling_profiler_benchmark [--hz=N] [--threads=N] [--rounds=N]
+//                                    [--work=N] [--backend=perf|timer]
+//                                    [--output=PATH]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sampling_profiler.h"
+
+// Two distinct call paths, so the profile has something to tell apart. They
+// are not exported, so they are named from the executable's .symtab.
+__attribute__((noinline)) uint64_t Mix(uint64_t state, int rounds) {
+  for (int i = 0; i < rounds; i++) {
+    state ^= state >> 33;
+    state *= 0xff51afd7ed558ccdULL;
+    state ^= state >> 29;
+  }
+  return state;
+}
+
+__attribute__((noinline)) uint64_t Checksum(const std::vector<uint32_t>& data) {
+  uint64_t a = 1;
+  uint64_t b = 0;
+  for (uint32_t value : data) {
+    a = (a + value) % 65521;
+    b = (b + a) % 65521;
+  }
+  return b << 16 | a;
+}
+
+__attribute__((noinline)) uint64_t RunWorkload(int work) {
+  std::vector<uint32_t> data(64 * 1024);
+  uint64_t result = 0;
+  for (int i = 0; i < work; i++) {
+    {
+      ProfilerScope scope("mix");
+      result += Mix(result + i, 200000);
+    }
+    for (size_t j = 0; j < data.size(); j++) {
+      data[j] = static_cast<uint32_t>(result + j);
+    }
+    ProfilerScope scope("checksum");
+    result += Checksum(data);
+  }
+  return result;
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  int hz = 1000;
+  int threads = 0;
+  int rounds = 5;
+  int work = 1500;
+  bool cpu_timer = false;
+  std::string output = "/tmp/sampling_profiler_benchmark.folded";
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (ParseFlag(argv[i], "--hz", &value)) {
+      options.hz = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--threads", &value)) {
+      options.threads = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--rounds", &value)) {
+      options.rounds = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--work", &value)) {
+      options.work = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--backend", &value) &&
+               (value == "perf" || value == "timer")) {
+      options.cpu_timer = value == "timer";
+    } else if (ParseFlag(argv[i], "--output", &value)) {
+      options.output = value;
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (options.threads <= 0) {
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return options;
+}
+
+double RunRound(const Options& options, uint64_t* sink) {
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> results(options.threads);
+  auto start = Clock::now();
+  for (int i = 0; i < options.threads; i++) {
+    threads.emplace_back(
+        [&options, &results, i] { results[i] = RunWorkload(options.work); });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (uint64_t result : results) {
+    *sink += result;
+  }
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  uint64_t sink = 0;
+  RunRound(options, &sink);
+
+  // Alternate the two modes so drift in clock speed affects both alike.
+  SamplingProfiler::Options profiler_options;
+  profiler_options.frequency_hz = options.hz;
+  profiler_options.force_cpu_timer = options.cpu_timer;
+  SamplingProfiler profiler(profiler_options);
+  double best_off = 1e9;
+  double best_on = 1e9;
+  double total_on = 0;
+  for (int round = 0; round < options.rounds; round++) {
+    best_off = std::min(best_off, RunRound(options, &sink));
+    if (!profiler.Start()) {
+      fprintf(stderr, "Could not start the profiler\n");
+      return 1;
+    }
+    double seconds = RunRound(options, &sink);
+    profiler.Stop();
+    best_on = std::min(best_on, seconds);
+    total_on += seconds;
+  }
+
+  SamplingProfiler::Stats stats = profiler.GetStats();
+  // Timers count CPU time, so at most one sample per core per period.
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  double cpu_seconds =
+      total_on * std::min(static_cast<unsigned>(options.threads), cores);
+  printf("%s, %d threads, %d Hz: %.3f s without profiler, %.3f s with, "
+         "overhead %.2f%%\n",
+         profiler.backend() == SamplingProfiler::Backend::kPerfEvent
+             ? "perf event"
+             : "CPU timer",
+         options.threads, options.hz, best_off, best_on,
+         100.0 * (best_on - best_off) / best_off);
+  printf("%llu samples (%.0f expected), %llu dropped, %zu threads, "
+         "%zu stacks, collector %.3f s CPU\n",
+         static_cast<unsigned long long>(stats.samples),
+         cpu_seconds * options.hz,
+         static_cast<unsigned long long>(stats.dropped), stats.threads,
+         stats.stacks, stats.collector_seconds);
+  if (!profiler.WriteFolded(options.output)) {
+    fprintf(stderr, "Could not write %s\n", options.output.c_str());
+    return 1;
+  }
+  printf("folded stacks written to %s (checksum %llx)\n",
+         options.output.c_str(), static_cast<unsigned long long>(sink));
+  return 0;
+}
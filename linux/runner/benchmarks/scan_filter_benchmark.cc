@@ -0,0 +1,197 @@
+// Replays five seconds of advertising from a crowded environment (500
+// advertisers, two of them sofas) through AdvertisementFilter and through the
+// scan loop the app used before: compare every name in the accumulated
+// result list on every report.
+//
+// Usage: scan_filter_benchmark [--advertisers=N] [--seconds=N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "scan_filter.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr char kSofaName[] = "ESP32_BLE_Sofa2";
+constexpr char kServiceUuid[] = "12345678-1234-5678-1234-56789abcdef0";
+
+struct Report {
+  uint64_t address;
+  int8_t rssi;
+  int64_t timestamp_ms;
+  std::string name;
+  std::vector<ServiceUuid> uuids;
+};
+
+struct Options {
+  int advertisers = 500;
+  int seconds = 5;
+};
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--advertisers=", 14) == 0) {
+      options.advertisers = atoi(argv[i] + 14);
+    } else if (strncmp(argv[i], "--seconds=", 10) == 0) {
+      options.seconds = atoi(argv[i] + 10);
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  return options;
+}
+
+// Every advertiser sends at 100-1000 ms intervals and each advertising event
+// is reported once per primary channel it was heard on, as controllers do
+// with duplicate filtering off.
+std::vector<Report> GenerateReports(const Options& options) {
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> interval(100, 1000);
+  std::uniform_int_distribution<int> base_rssi(-95, -50);
+  std::normal_distribution<double> noise(0.0, 4.0);
+  ServiceUuid sofa_service;
+  ParseServiceUuid(kServiceUuid, &sofa_service);
+  ServiceUuid other_service = sofa_service;
+  other_service.bytes[15] ^= 0xff;
+
+  std::vector<Report> reports;
+  int64_t end_ms = options.seconds * 1000LL;
+  for (int i = 0; i < options.advertisers; i++) {
+    Report report;
+    report.address = 0xc0ffee000000ULL + i;
+    int rssi = base_rssi(random);
+    int period = interval(random);
+    if (i == 0) {
+      // The sofa in the room.
+      report.name = kSofaName;
+      report.uuids.push_back(sofa_service);
+      rssi = -58;
+      period = 100;
+    } else if (i == 1) {
+      // A neighbour's sofa through the wall.
+      report.name = kSofaName;
+      report.uuids.push_back(sofa_service);
+      rssi = -84;
+      period = 100;
+    } else {
+      report.name = "Device-" + std::to_string(i);
+      report.uuids.push_back(other_service);
+    }
+    for (int64_t t = random() % period; t < end_ms; t += period) {
+      for (int channel = 0; channel < 3; channel++) {
+        Report copy = report;
+        copy.timestamp_ms = t + channel;
+        copy.rssi = static_cast<int8_t>(
+            std::max(-127.0, std::min(0.0, rssi + noise(random))));
+        reports.push_back(copy);
+      }
+    }
+  }
+  std::sort(reports.begin(), reports.end(),
+            [](const Report& a, const Report& b) {
+              return a.timestamp_ms < b.timestamp_ms;
+            });
+  return reports;
+}
+
+void RunFilter(const std::vector<Report>& reports) {
+  AdvertisementFilter::Options options;
+  options.service_uuids.push_back(ServiceUuid());
+  ParseServiceUuid(kServiceUuid, &options.service_uuids.back());
+  options.name_prefix = kSofaName;
+  AdvertisementFilter filter(options);
+
+  int64_t selected_ms = -1;
+  auto start = Clock::now();
+  for (const Report& report : reports) {
+    Advertisement advertisement = {report.address,
+                                   report.rssi,
+                                   report.timestamp_ms,
+                                   report.name.data(),
+                                   report.name.size(),
+                                   report.uuids.data(),
+                                   report.uuids.size()};
+    if (filter.Add(advertisement) ==
+            AdvertisementFilter::Verdict::kSelected &&
+        selected_ms < 0) {
+      selected_ms = report.timestamp_ms;
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+
+  const AdvertisementFilter::Stats& stats = filter.stats();
+  const AdvertisementFilter::Candidate* best = filter.Best();
+  printf("filter: %.1f ns/report, rejected=%llu duplicates=%llu "
+         "accepted=%llu, selected %012llx (%.1f dBm) at %lld ms\n",
+         ns / reports.size(), static_cast<unsigned long long>(stats.rejected),
+         static_cast<unsigned long long>(stats.duplicates),
+         static_cast<unsigned long long>(stats.accepted),
+         best ? static_cast<unsigned long long>(best->address) : 0ULL,
+         best ? best->smoothed_rssi : 0.0,
+         static_cast<long long>(selected_ms));
+}
+
+// The app's old loop: the plugin re-delivers the full list of devices seen so
+// far on every report and the callback compares each name as a string. It
+// connects to the first match, whichever sofa that is.
+void RunNaive(const std::vector<Report>& reports) {
+  std::vector<const Report*> results;
+  std::unordered_map<uint64_t, size_t> index;
+  int64_t found_ms = -1;
+  uint64_t found_address = 0;
+  uint64_t comparisons = 0;
+  size_t processed = 0;
+  auto start = Clock::now();
+  for (const Report& report : reports) {
+    processed++;
+    auto inserted = index.emplace(report.address, results.size());
+    if (inserted.second) {
+      results.push_back(&report);
+    } else {
+      results[inserted.first->second] = &report;
+    }
+    for (const Report* result : results) {
+      comparisons++;
+      if (result->name == kSofaName) {
+        found_ms = report.timestamp_ms;
+        found_address = result->address;
+        break;
+      }
+    }
+    if (found_ms >= 0) {
+      break;
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                  .count();
+  printf("naive:  %.1f ns/report, %.1f comparisons/report, first match "
+         "%012llx at %lld ms (no RSSI ranking)\n",
+         ns / processed, static_cast<double>(comparisons) / processed,
+         static_cast<unsigned long long>(found_address),
+         static_cast<long long>(found_ms));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  std::vector<Report> reports = GenerateReports(options);
+  printf("%zu reports from %d advertisers over %d s\n", reports.size(),
+         options.advertisers, options.seconds);
+  RunFilter(reports);
+  RunNaive(reports);
+  return 0;
+}
@@ -0,0 +1,278 @@
+// Checks TaskRunner's scheduling guarantees on real GLib main contexts, then
+// measures how long tasks wait for a worker and how results are batched back
+// to the platform thread:
+//   - Shutdown() straight after construction, before the workers have
+//     reached their main loops, returns and refuses further tasks;
+//   - waiting tasks start strictly in priority order, in posting order
+//     within a priority;
+//   - a task whose deadline passes while it waits is dropped;
+//   - a burst of results is delivered in one batch, in posting order, on the
+//     platform thread.
+// Exits with status 1 if a check fails.
+//
+// Usage: task_runner_benchmark [--tasks=N] [--threads=N]
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "task_runner.h"
+
+namespace {
+
+struct Options {
+  int tasks = 100000;
+  int threads = 2;
+};
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+Options ParseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (ParseFlag(argv[i], "--tasks", &value)) {
+      options.tasks = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--threads", &value)) {
+      options.threads = atoi(value.c_str());
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+  return options;
+}
+
+void Check(bool condition, const char* what) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s\n", what);
+    exit(1);
+  }
+}
+
+// Holds a worker inside a task until Open(), so that the tasks posted
+// meanwhile all wait and are then scheduled against each other.
+class Gate {
+ public:
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    entered_ = true;
+    changed_.notify_all();
+    changed_.wait(lock, [this] { return open_; });
+  }
+
+  void WaitUntilEntered() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return entered_; });
+  }
+
+  void Open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_ = true;
+    changed_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool entered_ = false;
+  bool open_ = false;
+};
+
+// Waits until every task posted to |queue| has either run or expired.
+void WaitForQueue(const TaskRunner& runner, size_t queue) {
+  while (runner.GetQueueStats(queue).pending > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// Runs the platform thread's main context until |done| returns true.
+template <typename Predicate>
+void IterateUntil(Predicate done) {
+  while (!done()) {
+    if (!g_main_context_iteration(nullptr, FALSE)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+}
+
+void CheckShutdownAfterConstruction() {
+  for (int i = 0; i < 200; i++) {
+    TaskRunner runner(2);
+    runner.Shutdown();
+    Check(!runner.PostTask(TaskRunner::kAnyQueue, G_PRIORITY_DEFAULT, 0,
+                           [] {}),
+          "PostTask() after Shutdown() is refused");
+  }
+  for (int i = 0; i < 200; i++) {
+    // The destructor shuts down on its own.
+    TaskRunner runner(2);
+  }
+  printf("shutdown after construction: ok\n");
+}
+
+void CheckPriorityOrder() {
+  TaskRunner runner(1);
+  Gate gate;
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto record = [&](const char* name) {
+    return [&mutex, &order, name] {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(name);
+    };
+  };
+
+  runner.PostTask(0, G_PRIORITY_DEFAULT, 0, [&gate] { gate.Wait(); });
+  gate.WaitUntilEntered();
+  runner.PostTask(0, G_PRIORITY_LOW, 0, record("low"));
+  runner.PostTask(0, G_PRIORITY_DEFAULT_IDLE, 0, record("default-idle"));
+  runner.PostTask(0, G_PRIORITY_DEFAULT, 0, record("default-1"));
+  runner.PostTask(0, G_PRIORITY_HIGH, 0, record("high"));
+  runner.PostTask(0, G_PRIORITY_DEFAULT, 0, record("default-2"));
+  runner.PostTask(0, G_PRIORITY_HIGH_IDLE, 0, record("high-idle"));
+  gate.Open();
+  WaitForQueue(runner, 0);
+
+  std::string actual;
+  for (const std::string& name : order) {
+    actual += name + " ";
+  }
+  printf("priority order: %s\n", actual.c_str());
+  Check(actual == "high default-1 default-2 high-idle default-idle low ",
+        "waiting tasks start in priority order");
+}
+
+void CheckDeadlines() {
+  TaskRunner runner(1);
+  Gate gate;
+  std::atomic<int> ran{0};
+  bool expired_ran = false;
+
+  runner.PostTask(0, G_PRIORITY_DEFAULT, 0, [&gate] { gate.Wait(); });
+  gate.WaitUntilEntered();
+  gint64 now_us = g_get_monotonic_time();
+  runner.PostTask(0, G_PRIORITY_DEFAULT, now_us + 2000,
+                  [&expired_ran] { expired_ran = true; });
+  runner.PostTask(0, G_PRIORITY_DEFAULT, 0, [&ran] { ran++; });
+  runner.PostTask(0, G_PRIORITY_DEFAULT, now_us + 10 * G_USEC_PER_SEC,
+                  [&ran] { ran++; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  gate.Open();
+  WaitForQueue(runner, 0);
+
+  TaskRunner::QueueStats stats = runner.GetQueueStats(0);
+  printf("deadlines: %llu completed, %llu expired\n",
+         static_cast<unsigned long long>(stats.completed),
+         static_cast<unsigned long long>(stats.expired));
+  Check(!expired_ran && stats.expired == 1,
+        "a task past its deadline is dropped");
+  Check(ran == 2 && stats.completed == 3,
+        "tasks without a deadline or within it still run");
+}
+
+void CheckResultBatching() {
+  const int kResults = 1000;
+  TaskRunner runner(1);
+  std::thread::id platform_thread = std::this_thread::get_id();
+  std::vector<int> delivered;
+  bool on_platform_thread = true;
+
+  runner.PostTask(0, G_PRIORITY_DEFAULT, 0, [&] {
+    for (int i = 0; i < kResults; i++) {
+      runner.PostResult([&, i] {
+        delivered.push_back(i);
+        on_platform_thread = on_platform_thread &&
+                             std::this_thread::get_id() == platform_thread;
+      });
+    }
+  });
+  // The platform thread is busy while the worker posts, so everything is
+  // waiting by the time it next iterates.
+  WaitForQueue(runner, 0);
+  IterateUntil([&] { return delivered.size() == kResults; });
+
+  TaskRunner::ResultStats stats = runner.GetResultStats();
+  printf("result batching: %llu results in %llu batches\n",
+         static_cast<unsigned long long>(stats.delivered),
+         static_cast<unsigned long long>(stats.batches));
+  Check(stats.batches == 1, "a burst of results is delivered in one batch");
+  bool in_order = true;
+  for (int i = 0; i < kResults; i++) {
+    in_order = in_order && delivered[i] == i;
+  }
+  Check(in_order, "results are delivered in posting order");
+  Check(on_platform_thread, "results run on the platform thread");
+}
+
+// Posts |tasks| small tasks that each post a result back, while the platform
+// thread keeps iterating, and reports the latencies.
+void Measure(const Options& options) {
+  TaskRunner runner(options.threads);
+  std::atomic<int> results{0};
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.tasks; i++) {
+    runner.PostTask(TaskRunner::kAnyQueue, G_PRIORITY_DEFAULT, 0, [&] {
+      volatile uint64_t sink = 0;
+      for (int j = 0; j < 200; j++) {
+        sink = sink + j;
+      }
+      runner.PostResult([&results] { results++; });
+    });
+    if (i % 64 == 0) {
+      g_main_context_iteration(nullptr, FALSE);
+    }
+  }
+  IterateUntil([&] { return results == options.tasks; });
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  printf("%d tasks on %zu workers in %.3fs (%.0f tasks/s)\n", options.tasks,
+         runner.queue_count(), seconds, options.tasks / seconds);
+  for (size_t i = 0; i < runner.queue_count(); i++) {
+    TaskRunner::QueueStats stats = runner.GetQueueStats(i);
+    printf("  worker %zu: %llu tasks, wait mean=%.0fus p99=%.0fus "
+           "max=%.0fus, run mean=%.1fus\n",
+           i, static_cast<unsigned long long>(stats.completed),
+           stats.mean_wait_us, stats.p99_wait_us, stats.max_wait_us,
+           stats.mean_run_us);
+  }
+  TaskRunner::ResultStats stats = runner.GetResultStats();
+  printf("  results: %llu in %llu batches (mean %.1f), latency mean=%.0fus "
+         "p99=%.0fus\n",
+         static_cast<unsigned long long>(stats.delivered),
+         static_cast<unsigned long long>(stats.batches),
+         stats.mean_batch_size, stats.mean_latency_us, stats.p99_latency_us);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = ParseOptions(argc, argv);
+  // A lost quit or a missed wake-up shows up as a hang; fail instead.
+  alarm(120);
+  CheckShutdownAfterConstruction();
+  CheckPriorityOrder();
+  CheckDeadlines();
+  CheckResultBatching();
+  Measure(options);
+  return 0;
+}
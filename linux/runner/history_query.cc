@@ -0,0 +1,295 @@
+#include "history_query.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "sampling_profiler.h"
+
+namespace {
+
+// Histogram range for each field. Values outside the range land in the first
+// or last bin.
+struct BinRange {
+  float low;
+  float high;
+};
+
+constexpr BinRange kBinRanges[kSensorFieldCount] = {
+    {-40.0f, 88.0f},     // Temperature, 0.125 C per bin.
+    {0.0f, 102.4f},      // Humidity, 0.1 % per bin.
+    {0.0f, 10240.0f},    // Gas, 10 ppm per bin.
+};
+
+size_t BinFor(SensorField field, float value) {
+  const BinRange& range = kBinRanges[field];
+  float scaled = (value - range.low) / (range.high - range.low) *
+                 HistoryAggregate::kBinCount;
+  if (!(scaled > 0)) {
+    return 0;
+  }
+  if (scaled >= HistoryAggregate::kBinCount) {
+    return HistoryAggregate::kBinCount - 1;
+  }
+  return static_cast<size_t>(scaled);
+}
+
+int64_t BucketFor(int64_t timestamp_ms, int64_t bucket_ms) {
+  if (bucket_ms <= 0) {
+    return 0;
+  }
+  int64_t bucket = timestamp_ms / bucket_ms;
+  if (timestamp_ms % bucket_ms < 0) {
+    bucket--;
+  }
+  return bucket * bucket_ms;
+}
+
+// Returns true if no sample summarized by |summary| can match |query|.
+bool CanSkip(const HistoryQuery& query, const SegmentSummary& summary) {
+  if (summary.sample_count == 0 ||
+      summary.last_timestamp_ms < query.start_ms ||
+      summary.first_timestamp_ms >= query.end_ms) {
+    return true;
+  }
+  for (const FieldPredicate& predicate : query.predicates) {
+    if (summary.max[predicate.field] < predicate.min ||
+        summary.min[predicate.field] > predicate.max) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns true if every sample summarized by |summary| matches |query|.
+bool AllMatch(const HistoryQuery& query, const SegmentSummary& summary) {
+  if (summary.first_timestamp_ms < query.start_ms ||
+      summary.last_timestamp_ms >= query.end_ms) {
+    return false;
+  }
+  for (const FieldPredicate& predicate : query.predicates) {
+    if (summary.min[predicate.field] < predicate.min ||
+        summary.max[predicate.field] > predicate.max) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Matches(const HistoryQuery& query, const SensorSample& sample) {
+  if (sample.timestamp_ms < query.start_ms ||
+      sample.timestamp_ms >= query.end_ms) {
+    return false;
+  }
+  for (const FieldPredicate& predicate : query.predicates) {
+    float value = sample.values[predicate.field];
+    if (value < predicate.min || value > predicate.max) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+constexpr size_t HistoryAggregate::kBinCount;
+
+HistoryAggregate::HistoryAggregate() {}
+
+void HistoryAggregate::Add(SensorField value_field, float value, float x,
+                           float y, int64_t duration_ms) {
+  if (bins_.empty()) {
+    bins_.resize(kBinCount);
+    value_field_ = value_field;
+  }
+  if (count_ == 0 || value < min_) {
+    min_ = value;
+  }
+  if (count_ == 0 || value > max_) {
+    max_ = value;
+  }
+  count_++;
+  sum_ += value;
+  duration_ms_ += duration_ms;
+  sum_x_ += x;
+  sum_y_ += y;
+  sum_xx_ += static_cast<double>(x) * x;
+  sum_yy_ += static_cast<double>(y) * y;
+  sum_xy_ += static_cast<double>(x) * y;
+  bins_[BinFor(value_field, value)]++;
+}
+
+void HistoryAggregate::Merge(const HistoryAggregate& other) {
+  if (other.count_ == 0) {
+    return;
+  }
+  if (bins_.empty()) {
+    bins_.resize(kBinCount);
+    value_field_ = other.value_field_;
+  }
+  if (count_ == 0 || other.min_ < min_) {
+    min_ = other.min_;
+  }
+  if (count_ == 0 || other.max_ > max_) {
+    max_ = other.max_;
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  duration_ms_ += other.duration_ms_;
+  sum_x_ += other.sum_x_;
+  sum_y_ += other.sum_y_;
+  sum_xx_ += other.sum_xx_;
+  sum_yy_ += other.sum_yy_;
+  sum_xy_ += other.sum_xy_;
+  for (size_t i = 0; i < kBinCount; i++) {
+    bins_[i] += other.bins_[i];
+  }
+}
+
+double HistoryAggregate::Percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  if (p <= 0) {
+    return min_;
+  }
+  if (p >= 100) {
+    return max_;
+  }
+  double rank = p / 100.0 * (count_ - 1);
+  uint64_t seen = 0;
+  const BinRange& range = kBinRanges[value_field_];
+  double bin_width = (range.high - range.low) / kBinCount;
+  for (size_t i = 0; i < kBinCount; i++) {
+    if (bins_[i] == 0) {
+      continue;
+    }
+    if (seen + bins_[i] > rank) {
+      // Interpolate within the bin, staying inside it, then clamp to the
+      // observed extremes, which the bin's edges can lie outside.
+      double within = std::min((rank - seen + 0.5) / bins_[i], 1.0);
+      double value = range.low + (i + within) * bin_width;
+      return std::min(std::max(value, static_cast<double>(min_)),
+                      static_cast<double>(max_));
+    }
+    seen += bins_[i];
+  }
+  return max_;
+}
+
+double HistoryAggregate::Correlation() const {
+  if (count_ < 2) {
+    return 0;
+  }
+  double n = static_cast<double>(count_);
+  double covariance = sum_xy_ - sum_x_ * sum_y_ / n;
+  double variance_x = sum_xx_ - sum_x_ * sum_x_ / n;
+  double variance_y = sum_yy_ - sum_y_ * sum_y_ / n;
+  if (variance_x <= 0 || variance_y <= 0) {
+    return 0;
+  }
+  return covariance / sqrt(variance_x * variance_y);
+}
+
+HistoryQueryEngine::HistoryQueryEngine(WorkStealingPool* pool) : pool_(pool) {}
+
+HistoryQueryEngine::~HistoryQueryEngine() {}
+
+bool HistoryQueryEngine::AddDevice(const std::string& path) {
+  std::unique_ptr<SensorHistoryReader> reader(new SensorHistoryReader());
+  if (!reader->Open(path)) {
+    return false;
+  }
+  readers_.push_back(std::move(reader));
+  return true;
+}
+
+bool HistoryQueryEngine::Run(const HistoryQuery& query,
+                             HistoryQueryResult* result) {
+  *result = HistoryQueryResult();
+
+  // Predicate pushdown: the segment headers alone decide which segments are
+  // worth reading.
+  std::vector<SegmentTask> tasks;
+  std::vector<SegmentSummary> summaries;
+  for (const auto& reader : readers_) {
+    summaries.resize(reader->SegmentCount());
+    for (size_t i = 0; i < summaries.size(); i++) {
+      if (!reader->ReadSummary(i, &summaries[i])) {
+        return false;
+      }
+    }
+    for (size_t i = 0; i < summaries.size(); i++) {
+      if (CanSkip(query, summaries[i])) {
+        result->segments_skipped++;
+        continue;
+      }
+      int64_t next_timestamp_ms = INT64_MIN;
+      if (i + 1 < summaries.size() && summaries[i + 1].sample_count > 0) {
+        next_timestamp_ms = summaries[i + 1].first_timestamp_ms;
+      }
+      tasks.push_back({reader.get(), i, next_timestamp_ms,
+                       AllMatch(query, summaries[i])});
+    }
+  }
+  result->segments_scanned = tasks.size();
+
+  // Each worker aggregates into its own buckets; they are merged once the
+  // scan is done so workers never contend on shared state.
+  size_t worker_count = pool_->thread_count();
+  std::vector<std::map<int64_t, HistoryAggregate>> partials(worker_count);
+  std::vector<std::vector<SensorSample>> buffers(worker_count);
+  std::vector<char> failed(worker_count, 0);
+
+  pool_->ParallelFor(tasks.size(), [&](size_t index, size_t worker) {
+    ProfilerScope scope("history-query");
+    const SegmentTask& task = tasks[index];
+    std::vector<SensorSample>& samples = buffers[worker];
+    if (!task.reader->ReadSamples(task.segment, &samples)) {
+      failed[worker] = 1;
+      return;
+    }
+    std::map<int64_t, HistoryAggregate>& buckets = partials[worker];
+    HistoryAggregate* current = nullptr;
+    int64_t current_bucket = 0;
+    size_t count = samples.size();
+    for (size_t i = 0; i < count; i++) {
+      const SensorSample& sample = samples[i];
+      if (!task.all_match && !Matches(query, sample)) {
+        continue;
+      }
+      // A sample stands for the time until the next reading, regardless of
+      // whether that reading matches or lies in the next segment. The last
+      // reading of a device is taken to last as long as the one before it.
+      int64_t gap = 0;
+      if (i + 1 < count) {
+        gap = samples[i + 1].timestamp_ms - sample.timestamp_ms;
+      } else if (task.next_timestamp_ms != INT64_MIN) {
+        gap = task.next_timestamp_ms - sample.timestamp_ms;
+      } else if (i > 0) {
+        gap = sample.timestamp_ms - samples[i - 1].timestamp_ms;
+      }
+      gap = std::min(std::max<int64_t>(gap, 0), query.max_sample_gap_ms);
+
+      int64_t bucket = BucketFor(sample.timestamp_ms, query.bucket_ms);
+      if (current == nullptr || bucket != current_bucket) {
+        current = &buckets[bucket];
+        current_bucket = bucket;
+      }
+      current->Add(query.value_field, sample.values[query.value_field],
+                   sample.values[query.correlation_x],
+                   sample.values[query.correlation_y], gap);
+    }
+  });
+
+  for (size_t worker = 0; worker < worker_count; worker++) {
+    if (failed[worker]) {
+      return false;
+    }
+    for (const auto& entry : partials[worker]) {
+      result->buckets[entry.first].Merge(entry.second);
+      result->total.Merge(entry.second);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,149 @@
+#ifndef RUNNER_HISTORY_QUERY_H_
+#define RUNNER_HISTORY_QUERY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "sensor_history.h"
+#include "work_stealing_pool.h"
+
+// Keeps samples whose |field| lies in the inclusive range [min, max].
+struct FieldPredicate {
+  SensorField field;
+  float min;
+  float max;
+};
+
+// A scan over the history of every registered device.
+struct HistoryQuery {
+  // Samples outside [start_ms, end_ms) are ignored.
+  int64_t start_ms = INT64_MIN;
+  int64_t end_ms = INT64_MAX;
+
+  // A sample is aggregated only when every predicate holds.
+  std::vector<FieldPredicate> predicates;
+
+  // The field whose distribution is recorded for percentiles, min and max.
+  SensorField value_field = kSensorTemperature;
+
+  // The pair of fields whose correlation is computed.
+  SensorField correlation_x = kSensorHumidity;
+  SensorField correlation_y = kSensorPpm;
+
+  // Width of the time buckets results are grouped into, e.g. one day. Zero
+  // groups everything into a single bucket.
+  int64_t bucket_ms = 0;
+
+  // Upper bound on the time a single sample is taken to represent when
+  // summing durations, so gaps in the history do not count as time spent in
+  // the matching state.
+  int64_t max_sample_gap_ms = 10 * 60 * 1000;
+};
+
+// Partial result of a scan. Aggregates from different segments and workers
+// are combined with Merge(), so every statistic here is kept in a form that
+// merges exactly.
+class HistoryAggregate {
+ public:
+  // Number of histogram bins used for percentiles.
+  static constexpr size_t kBinCount = 1024;
+
+  HistoryAggregate();
+
+  // Records one matching sample. |value| is the query's value field, |x| and
+  // |y| its correlation fields and |duration_ms| the time the sample covers.
+  void Add(SensorField value_field, float value, float x, float y,
+           int64_t duration_ms);
+
+  // Folds |other| into this aggregate.
+  void Merge(const HistoryAggregate& other);
+
+  uint64_t count() const { return count_; }
+  double mean() const { return count_ == 0 ? 0 : sum_ / count_; }
+  float min() const { return min_; }
+  float max() const { return max_; }
+
+  // Total time covered by matching samples.
+  int64_t duration_ms() const { return duration_ms_; }
+
+  // Returns the approximate |p|th percentile (0-100) of the value field,
+  // accurate to one histogram bin. The 0th and 100th are the exact minimum
+  // and maximum.
+  double Percentile(double p) const;
+
+  // Returns the Pearson correlation of the correlation fields, or 0 when it
+  // is undefined.
+  double Correlation() const;
+
+ private:
+  uint64_t count_ = 0;
+  double sum_ = 0;
+  float min_ = 0;
+  float max_ = 0;
+  int64_t duration_ms_ = 0;
+
+  // Co-moment sums for the correlation.
+  double sum_x_ = 0;
+  double sum_y_ = 0;
+  double sum_xx_ = 0;
+  double sum_yy_ = 0;
+  double sum_xy_ = 0;
+
+  SensorField value_field_ = kSensorTemperature;
+  std::vector<uint32_t> bins_;
+};
+
+struct HistoryQueryResult {
+  // Aggregates keyed by bucket start time. A query with bucket_ms == 0 has a
+  // single bucket keyed 0.
+  std::map<int64_t, HistoryAggregate> buckets;
+
+  // All buckets merged.
+  HistoryAggregate total;
+
+  // Segments that were read, and segments skipped using their block
+  // statistics alone.
+  size_t segments_scanned = 0;
+  size_t segments_skipped = 0;
+};
+
+// Runs queries over the history files of a set of devices, splitting each
+// scan by segment across a WorkStealingPool.
+class HistoryQueryEngine {
+ public:
+  // |pool| must outlive the engine.
+  explicit HistoryQueryEngine(WorkStealingPool* pool);
+  ~HistoryQueryEngine();
+
+  // Adds the history file at |path| to the set scanned by Run(). Returns true
+  // if the file could be opened.
+  bool AddDevice(const std::string& path);
+
+  // Runs |query| over every device and stores the merged aggregates in
+  // |result|. Returns false if a segment could not be read.
+  bool Run(const HistoryQuery& query, HistoryQueryResult* result);
+
+ private:
+  struct SegmentTask {
+    const SensorHistoryReader* reader;
+    size_t segment;
+
+    // Timestamp of the first sample after this segment, or INT64_MIN if the
+    // segment is the device's last.
+    int64_t next_timestamp_ms;
+
+    // True when the block statistics prove every sample satisfies the
+    // predicates, so per-sample checks can be skipped.
+    bool all_match;
+  };
+
+  WorkStealingPool* pool_;
+  std::vector<std::unique_ptr<SensorHistoryReader>> readers_;
+};
+
+#endif  // RUNNER_HISTORY_QUERY_H_
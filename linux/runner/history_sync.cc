@@ -0,0 +1,551 @@
+#include "history_sync.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <thread>
+
+#include "sampling_profiler.h"
+
+namespace {
+
+constexpr int kMaxAttempts = 4;
+constexpr size_t kSendSlice = 16 * 1024;
+constexpr int64_t kDayMs = 24 * 60 * 60 * 1000LL;
+
+int64_t NowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Splits "http://host[:port]/path" into its parts. Returns false for anything
+// else.
+bool ParseEndpoint(const std::string& endpoint, std::string* host,
+                   std::string* port, std::string* path) {
+  const std::string scheme = "http://";
+  if (endpoint.compare(0, scheme.size(), scheme) != 0) {
+    return false;
+  }
+  size_t authority_start = scheme.size();
+  size_t path_start = endpoint.find('/', authority_start);
+  std::string authority = endpoint.substr(
+      authority_start, path_start == std::string::npos
+                           ? std::string::npos
+                           : path_start - authority_start);
+  *path = path_start == std::string::npos ? "/" : endpoint.substr(path_start);
+  size_t colon = authority.rfind(':');
+  if (colon == std::string::npos) {
+    *host = authority;
+    *port = "80";
+  } else {
+    *host = authority.substr(0, colon);
+    *port = authority.substr(colon + 1);
+  }
+  return !host->empty() && !port->empty();
+}
+
+static_assert(std::numeric_limits<float>::is_iec559,
+              "the wire layout sends IEEE 754 floats");
+
+void PutLittleEndian(uint64_t value, int bytes, std::string* out) {
+  for (int i = 0; i < bytes; i++) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+uint64_t GetLittleEndian(const char* data, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+// Returns how many samples precede |watermark| in a device's history. The end
+// of a full segment may be given as its own capacity or as sample 0 of the
+// next segment; both have the same position.
+uint64_t Position(const SyncWatermark& watermark) {
+  return watermark.segment * kSegmentCapacity + watermark.sample;
+}
+
+// The inverse of Position(), with |sample| always within a segment.
+SyncWatermark AtPosition(uint64_t position) {
+  SyncWatermark watermark;
+  watermark.segment = position / kSegmentCapacity;
+  watermark.sample = static_cast<uint32_t>(position % kSegmentCapacity);
+  return watermark;
+}
+
+// Parses an "ACK <segment> <sample>" response body.
+bool ParseAck(const std::string& body, SyncWatermark* ack) {
+  unsigned long long segment = 0;
+  unsigned int sample = 0;
+  if (sscanf(body.c_str(), "ACK %llu %u", &segment, &sample) != 2 ||
+      segment >= UINT64_MAX / kSegmentCapacity - 1) {
+    return false;
+  }
+  ack->segment = segment;
+  ack->sample = sample;
+  return true;
+}
+
+// Returns the value of header |name| in the response head |head|, which has
+// its header names lower-cased, or an empty string.
+std::string HeaderValue(const std::string& head, const std::string& name) {
+  std::string key = "\r\n" + name + ":";
+  size_t start = head.find(key);
+  if (start == std::string::npos) {
+    return std::string();
+  }
+  start += key.size();
+  size_t end = head.find("\r\n", start);
+  std::string value = head.substr(start, end - start);
+  size_t first = value.find_first_not_of(' ');
+  return first == std::string::npos ? std::string() : value.substr(first);
+}
+
+}  // namespace
+
+void EncodeWireSamples(const SensorSample* samples, size_t count,
+                       std::string* out) {
+  out->reserve(out->size() + count * kWireSampleSize);
+  for (size_t i = 0; i < count; i++) {
+    PutLittleEndian(static_cast<uint64_t>(samples[i].timestamp_ms), 8, out);
+    for (float value : samples[i].values) {
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      PutLittleEndian(bits, 4, out);
+    }
+  }
+}
+
+bool DecodeWireSamples(const std::string& data,
+                       std::vector<SensorSample>* samples) {
+  if (data.size() % kWireSampleSize != 0) {
+    return false;
+  }
+  samples->resize(data.size() / kWireSampleSize);
+  const char* record = data.data();
+  for (SensorSample& sample : *samples) {
+    sample = SensorSample();
+    sample.timestamp_ms = static_cast<int64_t>(GetLittleEndian(record, 8));
+    for (int field = 0; field < kSensorFieldCount; field++) {
+      uint32_t bits =
+          static_cast<uint32_t>(GetLittleEndian(record + 8 + 4 * field, 4));
+      memcpy(&sample.values[field], &bits, sizeof(bits));
+    }
+    record += kWireSampleSize;
+  }
+  return true;
+}
+
+constexpr size_t HistorySync::kMaxDeviceIdLength;
+constexpr int HistorySync::kMaxBackwardResyncs;
+
+HistorySync::HistorySync(const Options& options) : options_(options) {
+  if (options_.chunk_samples == 0) {
+    options_.chunk_samples = 1;
+  }
+  ParseEndpoint(options_.endpoint, &host_, &port_, &path_);
+  LoadState();
+}
+
+HistorySync::~HistorySync() { Disconnect(); }
+
+bool HistorySync::AddDevice(const std::string& device_id,
+                            const std::string& path) {
+  if (device_id.empty() || device_id.size() > kMaxDeviceIdLength) {
+    return false;
+  }
+  for (char c : device_id) {
+    unsigned char byte = static_cast<unsigned char>(c);
+    if (byte <= ' ' || byte == 0x7f) {
+      return false;
+    }
+  }
+  devices_.push_back({device_id, path});
+  return true;
+}
+
+bool HistorySync::Sync() {
+  if (host_.empty()) {
+    return false;
+  }
+  ProfilerScope scope("history-sync");
+  int64_t start_ns = NowNs();
+  bool synced = true;
+  for (const Device& device : devices_) {
+    if (!SyncDevice(device)) {
+      synced = false;
+    }
+  }
+  Disconnect();
+  stats_.seconds += (NowNs() - start_ns) / 1e9;
+  return synced;
+}
+
+SyncWatermark HistorySync::GetWatermark(const std::string& device_id) const {
+  auto found = watermarks_.find(device_id);
+  return found == watermarks_.end() ? SyncWatermark() : found->second;
+}
+
+bool HistorySync::SyncDevice(const Device& device) {
+  SensorHistoryReader reader;
+  if (!reader.Open(device.path)) {
+    return false;
+  }
+  size_t segment_count = reader.SegmentCount();
+  uint64_t local_end = 0;
+  if (segment_count > 0) {
+    SegmentSummary summary;
+    if (!reader.ReadSummary(segment_count - 1, &summary)) {
+      return false;
+    }
+    local_end = (segment_count - 1) * kSegmentCapacity + summary.sample_count;
+  }
+
+  SyncWatermark watermark = AtPosition(Position(GetWatermark(device.id)));
+  std::vector<SensorSample> chunk;
+  std::vector<SensorSample> segment;
+  uint64_t loaded_segment = UINT64_MAX;
+  int64_t first_ms = INT64_MAX;
+  int64_t last_ms = INT64_MIN;
+  int attempts = 0;
+  int backward_resyncs = 0;
+  bool synced = true;
+
+  while (true) {
+    // Collect the samples after the watermark, crossing into following
+    // segments until the chunk is full.
+    chunk.clear();
+    SyncWatermark cursor = watermark;
+    while (chunk.size() < options_.chunk_samples &&
+           cursor.segment < segment_count) {
+      if (cursor.segment != loaded_segment) {
+        if (!reader.ReadSamples(cursor.segment, &segment)) {
+          return false;
+        }
+        loaded_segment = cursor.segment;
+      }
+      if (cursor.sample >= segment.size()) {
+        if (segment.size() < kSegmentCapacity) {
+          // The last, still growing segment has nothing new.
+          break;
+        }
+        cursor.segment++;
+        cursor.sample = 0;
+        continue;
+      }
+      size_t take = std::min<size_t>(options_.chunk_samples - chunk.size(),
+                                     segment.size() - cursor.sample);
+      chunk.insert(chunk.end(), segment.begin() + cursor.sample,
+                   segment.begin() + cursor.sample + take);
+      cursor.sample += take;
+    }
+    // The last segment may have grown since its summary was read.
+    local_end = std::max(local_end, Position(cursor));
+    if (Position(watermark) > local_end) {
+      // The state file claims the collector holds samples this device never
+      // had. Uploading nothing would look like a completed sync.
+      synced = false;
+      break;
+    }
+    if (chunk.empty()) {
+      break;
+    }
+
+    SyncWatermark ack;
+    int status = Upload(device, watermark, chunk, &ack);
+    if (status < 0) {
+      if (++attempts >= kMaxAttempts) {
+        synced = false;
+        break;
+      }
+      stats_.retries++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100 << attempts));
+      continue;
+    }
+    attempts = 0;
+
+    uint64_t from = Position(watermark);
+    uint64_t acked = Position(ack);
+    if (status == 200) {
+      // The collector must have stored part of this chunk, and no more.
+      if (acked <= from || acked > Position(cursor)) {
+        synced = false;
+        break;
+      }
+      first_ms = std::min(first_ms, chunk.front().timestamp_ms);
+      last_ms = std::max(last_ms, chunk[acked - from - 1].timestamp_ms);
+    } else if (acked > local_end) {
+      // Checked before the watermark is saved, so a bad reply is not carried
+      // into the next Sync().
+      synced = false;
+      break;
+    } else if (acked <= from && ++backward_resyncs > kMaxBackwardResyncs) {
+      synced = false;
+      break;
+    }
+
+    watermark = AtPosition(acked);
+    watermarks_[device.id] = watermark;
+    if (!SaveState()) {
+      synced = false;
+      break;
+    }
+  }
+
+  if (last_ms >= first_ms) {
+    stats_.device_days += static_cast<double>(last_ms - first_ms) / kDayMs;
+  }
+  return synced;
+}
+
+int HistorySync::Upload(const Device& device, const SyncWatermark& from,
+                        const std::vector<SensorSample>& samples,
+                        SyncWatermark* ack) {
+  std::string raw;
+  EncodeWireSamples(samples.data(), samples.size(), &raw);
+  uLong raw_size = static_cast<uLong>(raw.size());
+  uLongf compressed_size = compressBound(raw_size);
+  std::string body(compressed_size, '\0');
+  if (compress2(reinterpret_cast<Bytef*>(&body[0]), &compressed_size,
+                reinterpret_cast<const Bytef*>(raw.data()), raw_size,
+                options_.compression_level) != Z_OK) {
+    return -1;
+  }
+  body.resize(compressed_size);
+
+  char head[512];
+  snprintf(head, sizeof(head),
+           "POST %s HTTP/1.1\r\n"
+           "Host: %s:%s\r\n"
+           "Content-Type: application/octet-stream\r\n"
+           "Content-Encoding: deflate\r\n"
+           "Content-Length: %zu\r\n"
+           "X-Sofa-From: %llu:%u\r\n"
+           "X-Sofa-Count: %zu\r\n",
+           path_.c_str(), host_.c_str(), port_.c_str(), body.size(),
+           static_cast<unsigned long long>(from.segment), from.sample,
+           samples.size());
+  std::string request = head;
+  request += "X-Sofa-Device: " + device.id + "\r\n\r\n";
+  request += body;
+
+  std::string response;
+  int status = Exchange(request, &response);
+  if (status != 200 && status != 409) {
+    return -1;
+  }
+  if (!ParseAck(response, ack)) {
+    return -1;
+  }
+  if (status == 200) {
+    stats_.chunks++;
+    stats_.samples += samples.size();
+    stats_.raw_bytes += raw_size;
+  } else {
+    stats_.resyncs++;
+  }
+  return status;
+}
+
+int HistorySync::Exchange(const std::string& request, std::string* body) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = socket_ >= 0;
+    if (!reused && !Connect()) {
+      return -1;
+    }
+    if (!SendThrottled(request.data(), request.size())) {
+      Disconnect();
+      if (reused) {
+        continue;
+      }
+      return -1;
+    }
+
+    std::string response;
+    size_t head_end = std::string::npos;
+    size_t content_length = 0;
+    char buffer[4096];
+    while (true) {
+      ssize_t received = recv(socket_, buffer, sizeof(buffer), 0);
+      if (received < 0 && errno == EINTR) {
+        continue;
+      }
+      if (received <= 0) {
+        break;
+      }
+      response.append(buffer, received);
+      if (head_end == std::string::npos) {
+        head_end = response.find("\r\n\r\n");
+        if (head_end != std::string::npos) {
+          std::string head = response.substr(0, head_end + 2);
+          std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+          content_length = strtoul(
+              HeaderValue(head, "content-length").c_str(), nullptr, 10);
+          if (HeaderValue(head, "connection") == "close") {
+            // Read to the end, then drop the connection below.
+            content_length = SIZE_MAX;
+          }
+        }
+      }
+      if (head_end != std::string::npos && content_length != SIZE_MAX &&
+          response.size() >= head_end + 4 + content_length) {
+        break;
+      }
+    }
+
+    if (head_end == std::string::npos) {
+      // The connection closed before a response arrived. A kept-alive
+      // connection may simply have timed out, so try a fresh one once.
+      Disconnect();
+      if (reused) {
+        continue;
+      }
+      return -1;
+    }
+    int status = 0;
+    if (sscanf(response.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+      Disconnect();
+      return -1;
+    }
+    *body = response.substr(head_end + 4);
+    if (content_length == SIZE_MAX) {
+      Disconnect();
+    } else {
+      body->resize(std::min(body->size(), content_length));
+    }
+    return status;
+  }
+  return -1;
+}
+
+bool HistorySync::Connect() {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addresses = nullptr;
+  if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addresses) != 0) {
+    return false;
+  }
+
+  struct timeval timeout;
+  timeout.tv_sec = options_.timeout_ms / 1000;
+  timeout.tv_usec = (options_.timeout_ms % 1000) * 1000;
+  for (struct addrinfo* address = addresses; address != nullptr;
+       address = address->ai_next) {
+    int fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC,
+                    address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      socket_ = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(addresses);
+  return socket_ >= 0;
+}
+
+void HistorySync::Disconnect() {
+  if (socket_ >= 0) {
+    close(socket_);
+    socket_ = -1;
+  }
+}
+
+bool HistorySync::SendThrottled(const char* data, size_t size) {
+  double rate = static_cast<double>(options_.max_bytes_per_second);
+  while (size > 0) {
+    size_t slice = std::min(size, kSendSlice);
+    if (rate > 0) {
+      // Refill the bucket, holding at most one second's worth of bytes.
+      int64_t now_ns = NowNs();
+      if (tokens_updated_ns_ == 0) {
+        tokens_ = rate;
+      } else {
+        double refill = rate * (now_ns - tokens_updated_ns_) / 1e9;
+        tokens_ = std::min(rate, tokens_ + refill);
+      }
+      tokens_updated_ns_ = now_ns;
+      slice = std::min<size_t>(slice, std::max<size_t>(1, rate));
+      if (tokens_ < slice) {
+        double wait_s = (slice - tokens_) / rate;
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            static_cast<int64_t>(wait_s * 1e6)));
+        continue;
+      }
+      tokens_ -= slice;
+    }
+
+    ssize_t sent = send(socket_, data, slice, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    if (rate > 0) {
+      tokens_ += slice - sent;
+    }
+    stats_.sent_bytes += sent;
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool HistorySync::LoadState() {
+  FILE* file = fopen(options_.state_path.c_str(), "r");
+  if (file == nullptr) {
+    return false;
+  }
+  char id[kMaxDeviceIdLength + 1];
+  unsigned long long segment;
+  unsigned int sample;
+  static_assert(kMaxDeviceIdLength == 255, "update the fscanf width");
+  while (fscanf(file, "%255s %llu %u", id, &segment, &sample) == 3) {
+    SyncWatermark watermark;
+    watermark.segment = segment;
+    watermark.sample = sample;
+    watermarks_[id] = watermark;
+  }
+  fclose(file);
+  return true;
+}
+
+bool HistorySync::SaveState() const {
+  // Write a new file and rename it over the old one so an interruption never
+  // leaves a torn state file.
+  std::string temporary = options_.state_path + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+  for (const auto& entry : watermarks_) {
+    fprintf(file, "%s %llu %u\n", entry.first.c_str(),
+            static_cast<unsigned long long>(entry.second.segment),
+            entry.second.sample);
+  }
+  bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  return ok && rename(temporary.c_str(), options_.state_path.c_str()) == 0;
+}
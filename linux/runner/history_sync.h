@@ -0,0 +1,176 @@
+#ifndef RUNNER_HISTORY_SYNC_H_
+#define RUNNER_HISTORY_SYNC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sensor_history.h"
+
+// How far a collector has acknowledged a device's history: every sample
+// before |sample| in segment |segment| has been stored.
+struct SyncWatermark {
+  uint64_t segment = 0;
+  uint32_t sample = 0;
+};
+
+// Size of one sample on the wire: the timestamp as a little-endian int64,
+// then each value as a little-endian IEEE 754 float. SensorSample::reserved
+// is not sent.
+constexpr size_t kWireSampleSize = 8 + 4 * kSensorFieldCount;
+
+// Appends |count| samples to |out| in the wire layout.
+void EncodeWireSamples(const SensorSample* samples, size_t count,
+                       std::string* out);
+
+// Decodes |data| in the wire layout into |samples|. Returns false if |data|
+// is not a whole number of samples.
+bool DecodeWireSamples(const std::string& data,
+                       std::vector<SensorSample>* samples);
+
+// Uploads sensor history to a collector over HTTP, sending only the samples
+// added since the collector's last acknowledgement.
+//
+// Samples are batched into chunks of up to Options::chunk_samples, compressed
+// with zlib and POSTed as application/octet-stream. The collector replies
+// with its new watermark, which is persisted to the state file before the
+// next chunk is sent, so an interrupted upload resumes where it stopped. If
+// the collector already holds more (or less) than the client believes, it
+// replies 409 with its own watermark and the client continues from there.
+//
+// A device fails to sync, keeping its last saved watermark, if the collector
+// answers 200 without taking part of the chunk, acknowledges more than was
+// sent, names a watermark past the end of the local history, or repeatedly
+// sends the client back (see kMaxBackwardResyncs).
+//
+// Request:
+//   POST <path> HTTP/1.1
+//   Content-Encoding: deflate
+//   X-Sofa-Device: <device id>
+//   X-Sofa-From: <segment>:<sample>
+//   X-Sofa-Count: <count>
+//   body: zlib(<count> samples in the wire layout, see kWireSampleSize)
+//
+// Response body (200 or 409):
+//   ACK <segment> <sample>
+class HistorySync {
+ public:
+  // Longest device ID AddDevice() accepts.
+  static constexpr size_t kMaxDeviceIdLength = 255;
+
+  // 409 replies that move a device's watermark back, or leave it where it
+  // was, followed per device per Sync(). Forward moves are bounded by the
+  // local history; backward ones could repeat forever.
+  static constexpr int kMaxBackwardResyncs = 2;
+
+  struct Options {
+    // Collector endpoint, e.g. "http://127.0.0.1:8080/ingest". Only plain
+    // HTTP is supported.
+    std::string endpoint;
+
+    // File that stores the acknowledged watermark of every device.
+    std::string state_path;
+
+    // Maximum samples per uploaded chunk.
+    uint32_t chunk_samples = 16384;
+
+    // Upload bandwidth limit in bytes per second. Zero means unlimited.
+    uint64_t max_bytes_per_second = 0;
+
+    // Socket send and receive timeout.
+    int timeout_ms = 10000;
+
+    // zlib compression level.
+    int compression_level = 6;
+  };
+
+  struct Stats {
+    uint64_t chunks = 0;
+    uint64_t samples = 0;
+
+    // Uncompressed sample bytes, and bytes actually sent including HTTP
+    // headers.
+    uint64_t raw_bytes = 0;
+    uint64_t sent_bytes = 0;
+
+    // Requests that failed and were retried, and 409 resynchronisations.
+    uint64_t retries = 0;
+    uint64_t resyncs = 0;
+
+    // Sum over devices of the time span uploaded, in days.
+    double device_days = 0;
+
+    // Wall time spent in Sync().
+    double seconds = 0;
+
+    double bytes_per_device_day() const {
+      return device_days == 0 ? 0 : sent_bytes / device_days;
+    }
+  };
+
+  explicit HistorySync(const Options& options);
+  ~HistorySync();
+
+  HistorySync(const HistorySync&) = delete;
+  HistorySync& operator=(const HistorySync&) = delete;
+
+  // Adds a device whose history file at |path| should be uploaded. Returns
+  // false, adding nothing, if |device_id| is empty, longer than
+  // kMaxDeviceIdLength or contains whitespace or control characters, none of
+  // which can go into the request header or the state file.
+  bool AddDevice(const std::string& device_id, const std::string& path);
+
+  // Uploads everything not yet acknowledged for every device. Returns true if
+  // all devices are fully synced; on false the next call resumes from the
+  // last acknowledged chunk.
+  bool Sync();
+
+  // Returns the acknowledged watermark of |device_id|.
+  SyncWatermark GetWatermark(const std::string& device_id) const;
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  struct Device {
+    std::string id;
+    std::string path;
+  };
+
+  bool SyncDevice(const Device& device);
+
+  // Sends one chunk. Returns 200 or 409 with the collector's watermark in
+  // |ack|, or -1 if the request failed and may be retried.
+  int Upload(const Device& device, const SyncWatermark& from,
+             const std::vector<SensorSample>& samples, SyncWatermark* ack);
+
+  // Sends |request| and reads the response, reconnecting once if the kept
+  // alive connection was closed. Returns the HTTP status, or -1 on error.
+  int Exchange(const std::string& request, std::string* body);
+
+  bool Connect();
+  void Disconnect();
+  bool SendThrottled(const char* data, size_t size);
+
+  bool LoadState();
+  bool SaveState() const;
+
+  Options options_;
+  std::string host_;
+  std::string port_;
+  std::string path_;
+  int socket_ = -1;
+
+  std::vector<Device> devices_;
+  std::map<std::string, SyncWatermark> watermarks_;
+
+  // Token bucket for the bandwidth limit.
+  double tokens_ = 0;
+  int64_t tokens_updated_ns_ = 0;
+
+  Stats stats_;
+};
+
+#endif  // RUNNER_HISTORY_SYNC_H_
@@ -0,0 +1,50 @@
+#ifndef RUNNER_LATENCY_HISTOGRAM_H_
+#define RUNNER_LATENCY_HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Records latencies in power-of-two microsecond buckets so percentiles can be
+// reported without keeping every sample. Not thread safe.
+class LatencyHistogram {
+ public:
+  void Add(double latency_us) {
+    size_t bucket = 0;
+    while (bucket < kBucketCount - 1 && latency_us >= (2ULL << bucket)) {
+      bucket++;
+    }
+    buckets_[bucket]++;
+    count_++;
+    total_us_ += latency_us;
+    if (latency_us > max_us_) {
+      max_us_ = latency_us;
+    }
+  }
+
+  uint64_t count() const { return count_; }
+  double mean_us() const { return count_ == 0 ? 0 : total_us_ / count_; }
+  double max_us() const { return max_us_; }
+
+  // Returns the midpoint of the bucket holding the |p|th percentile (0-100),
+  // or 0 if nothing has been recorded.
+  double Percentile(double p) const {
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; i++) {
+      seen += buckets_[i];
+      if (seen > 0 && seen >= count_ * p / 100) {
+        return 1.5 * (1ULL << i);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  static constexpr size_t kBucketCount = 32;
+
+  uint64_t buckets_[kBucketCount] = {};
+  uint64_t count_ = 0;
+  double total_us_ = 0;
+  double max_us_ = 0;
+};
+
+#endif  // RUNNER_LATENCY_HISTOGRAM_H_
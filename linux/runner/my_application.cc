@@ -1,15 +1,38 @@
 #include "my_application.h"
 
+#include <string.h>
+#include <unistd.h>
+
 #include <flutter_linux/flutter_linux.h>
 #ifdef GDK_WINDOWING_X11
 #include <gdk/gdkx.h>
 #endif
 
+#include "async_writer.h"
 #include "flutter/generated_plugin_registrant.h"
+#include "sampling_profiler.h"
+#include "task_runner.h"
+
+// Number of native worker threads available to plugins.
+static const size_t kWorkerThreadCount = 2;
+
+// Sampling rate used by --profile without a value.
+static const int kDefaultProfileHz = 1000;
 
 struct _MyApplication {
   GtkApplication parent_instance;
   char** dart_entrypoint_arguments;
+
+  // Performs history, journal and trace writes off the platform thread.
+  AsyncWriter* async_writer;
+
+  // Worker threads for native BLE, storage and analytics work.
+  TaskRunner* task_runner;
+
+  // Samples native stacks when started with --profile; the folded stacks are
+  // written to profile_path on shutdown.
+  SamplingProfiler* profiler;
+  gchar* profile_path;
 };
 
 G_DEFINE_TYPE(MyApplication, my_application, GTK_TYPE_APPLICATION)
@@ -62,11 +85,81 @@ static void my_application_activate(GApplication* application) {
   gtk_widget_grab_focus(GTK_WIDGET(view));
 }
 
+// Consumes the runner's own profiling flags:
+//   --profile[=HZ]         sample native stacks, by default at 1 kHz
+//   --profile-output=PATH  where to write the folded stacks
+// Returns FALSE for any other argument.
+static gboolean my_application_parse_profile_flag(MyApplication* self,
+                                                  const gchar* argument,
+                                                  int* profile_hz) {
+  if (g_strcmp0(argument, "--profile") == 0) {
+    *profile_hz = kDefaultProfileHz;
+    return TRUE;
+  }
+  if (g_str_has_prefix(argument, "--profile=")) {
+    *profile_hz = static_cast<int>(
+        g_ascii_strtoll(argument + strlen("--profile="), nullptr, 10));
+    if (*profile_hz <= 0) {
+      g_warning("Ignoring invalid %s", argument);
+    }
+    return TRUE;
+  }
+  if (g_str_has_prefix(argument, "--profile-output=")) {
+    g_free(self->profile_path);
+    self->profile_path = g_strdup(argument + strlen("--profile-output="));
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// Starts the sampling profiler, before startup so that it is covered too.
+static void my_application_start_profiler(MyApplication* self, int hz) {
+  if (self->profile_path == nullptr) {
+    g_autofree gchar* name =
+        g_strdup_printf("%s-%d.folded", g_get_prgname(), getpid());
+    self->profile_path = g_build_filename(g_get_tmp_dir(), name, nullptr);
+  }
+  SamplingProfiler::Options options;
+  options.frequency_hz = hz;
+  self->profiler = new SamplingProfiler(options);
+  if (!self->profiler->Start()) {
+    g_warning("Failed to start the sampling profiler");
+    delete self->profiler;
+    self->profiler = nullptr;
+    return;
+  }
+  if (self->profiler->backend() == SamplingProfiler::Backend::kPerfEvent) {
+    g_message("Profiling native threads at %d Hz (perf events)", hz);
+    return;
+  }
+  g_message("Profiling native threads with CPU timers");
+  if (hz > SamplingProfiler::kTypicalTickHz) {
+    g_warning("CPU timers fire at most once per scheduler tick, usually %d Hz, "
+              "so %d Hz will not be reached; set kernel.perf_event_paranoid "
+              "to 2 or lower to use perf events",
+              SamplingProfiler::kTypicalTickHz, hz);
+  }
+}
+
 // Implements GApplication::local_command_line.
 static gboolean my_application_local_command_line(GApplication* application, gchar*** arguments, int* exit_status) {
   MyApplication* self = MY_APPLICATION(application);
-  // Strip out the first argument as it is the binary name.
-  self->dart_entrypoint_arguments = g_strdupv(*arguments + 1);
+  // Strip out the first argument as it is the binary name, and the runner's
+  // own flags, which the Dart entrypoint does not expect.
+  GPtrArray* dart_arguments = g_ptr_array_new();
+  int profile_hz = 0;
+  for (gchar** argument = *arguments + 1; *argument != nullptr; argument++) {
+    if (!my_application_parse_profile_flag(self, *argument, &profile_hz)) {
+      g_ptr_array_add(dart_arguments, g_strdup(*argument));
+    }
+  }
+  g_ptr_array_add(dart_arguments, nullptr);
+  self->dart_entrypoint_arguments =
+      reinterpret_cast<char**>(g_ptr_array_free(dart_arguments, FALSE));
+
+  if (profile_hz > 0) {
+    my_application_start_profiler(self, profile_hz);
+  }
 
   g_autoptr(GError) error = nullptr;
   if (!g_application_register(application, nullptr, &error)) {
@@ -83,18 +176,71 @@ static gboolean my_application_local_command_line(GApplication* application, gch
 
 // Implements GApplication::startup.
 static void my_application_startup(GApplication* application) {
-  //MyApplication* self = MY_APPLICATION(object);
+  MyApplication* self = MY_APPLICATION(application);
 
   // Perform any actions required at application startup.
+  self->async_writer = new AsyncWriter(AsyncWriter::Options());
+  self->async_writer->Start();
+  self->task_runner = new TaskRunner(kWorkerThreadCount);
 
   G_APPLICATION_CLASS(my_application_parent_class)->startup(application);
 }
 
 // Implements GApplication::shutdown.
 static void my_application_shutdown(GApplication* application) {
-  //MyApplication* self = MY_APPLICATION(object);
+  MyApplication* self = MY_APPLICATION(application);
 
   // Perform any actions required at application shutdown.
+  if (self->task_runner != nullptr) {
+    // Workers may still be queuing writes, so they stop first.
+    self->task_runner->Shutdown();
+    for (size_t i = 0; i < self->task_runner->queue_count(); i++) {
+      TaskRunner::QueueStats stats = self->task_runner->GetQueueStats(i);
+      g_debug("Worker %zu: %" G_GUINT64_FORMAT " tasks, "
+              "%" G_GUINT64_FORMAT " expired, %" G_GUINT64_FORMAT " dropped, "
+              "wait mean %.0fus p99 %.0fus max %.0fus, run mean %.0fus",
+              i, stats.completed, stats.expired, stats.pending,
+              stats.mean_wait_us, stats.p99_wait_us, stats.max_wait_us,
+              stats.mean_run_us);
+    }
+    TaskRunner::ResultStats results = self->task_runner->GetResultStats();
+    g_debug("Worker results: %" G_GUINT64_FORMAT " in %" G_GUINT64_FORMAT
+            " batches, latency mean %.0fus p99 %.0fus",
+            results.delivered, results.batches, results.mean_latency_us,
+            results.p99_latency_us);
+    delete self->task_runner;
+    self->task_runner = nullptr;
+  }
+  if (self->async_writer != nullptr) {
+    // Flushes every queued write before the process exits.
+    self->async_writer->Stop();
+    AsyncWriter::Stats stats = self->async_writer->GetStats();
+    g_debug("Async writer (%s): %" G_GUINT64_FORMAT " writes, "
+            "%" G_GUINT64_FORMAT " failed, %" G_GUINT64_FORMAT " refused, "
+            "max queue %zu, latency p50 %.0fus p99 %.0fus",
+            self->async_writer->backend() == AsyncWriter::Backend::kIoUring
+                ? "io_uring"
+                : "thread pool",
+            stats.completed, stats.failed, stats.rejected,
+            stats.max_queue_depth, stats.p50_latency_us, stats.p99_latency_us);
+    delete self->async_writer;
+    self->async_writer = nullptr;
+  }
+  if (self->profiler != nullptr) {
+    // Stops last so that the shutdown of the other subsystems is included.
+    self->profiler->Stop();
+    SamplingProfiler::Stats stats = self->profiler->GetStats();
+    if (self->profiler->WriteFolded(self->profile_path)) {
+      g_message("Wrote %" G_GUINT64_FORMAT " samples (%" G_GUINT64_FORMAT
+                " dropped) from %zu threads to %s",
+                stats.samples, stats.dropped, stats.threads,
+                self->profile_path);
+    } else {
+      g_warning("Failed to write profile to %s", self->profile_path);
+    }
+    delete self->profiler;
+    self->profiler = nullptr;
+  }
 
   G_APPLICATION_CLASS(my_application_parent_class)->shutdown(application);
 }
@@ -103,6 +249,12 @@ static void my_application_shutdown(GApplication* application) {
 static void my_application_dispose(GObject* object) {
   MyApplication* self = MY_APPLICATION(object);
   g_clear_pointer(&self->dart_entrypoint_arguments, g_strfreev);
+  // Only still set if the application never started up.
+  if (self->profiler != nullptr) {
+    delete self->profiler;
+    self->profiler = nullptr;
+  }
+  g_clear_pointer(&self->profile_path, g_free);
   G_OBJECT_CLASS(my_application_parent_class)->dispose(object);
 }
 
@@ -116,6 +268,16 @@ static void my_application_class_init(MyApplicationClass* klass) {
 
 static void my_application_init(MyApplication* self) {}
 
+AsyncWriter* my_application_get_async_writer(MyApplication* self) {
+  g_return_val_if_fail(MY_IS_APPLICATION(self), nullptr);
+  return self->async_writer;
+}
+
+TaskRunner* my_application_get_task_runner(MyApplication* self) {
+  g_return_val_if_fail(MY_IS_APPLICATION(self), nullptr);
+  return self->task_runner;
+}
+
 MyApplication* my_application_new() {
   // Set the program name to the application ID, which helps various systems
   // like GTK and desktop environments map this running application to its
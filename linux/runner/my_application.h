@@ -3,6 +3,9 @@
 
 #include <gtk/gtk.h>
 
+class AsyncWriter;
+class TaskRunner;
+
 G_DECLARE_FINAL_TYPE(MyApplication, my_application, MY, APPLICATION,
                      GtkApplication)
 
@@ -15,4 +18,31 @@ G_DECLARE_FINAL_TYPE(MyApplication, my_application, MY, APPLICATION,
  */
 MyApplication* my_application_new();
 
+/**
+ * my_application_get_async_writer:
+ * @self: a #MyApplication.
+ *
+ * Gets the writer that native code should use for history, journal and trace
+ * output so that it never blocks the platform thread. Writes are refused
+ * rather than queued without bound once its buffers are full.
+ *
+ * Returns: the application's #AsyncWriter, or %NULL outside
+ * startup/shutdown.
+ */
+AsyncWriter* my_application_get_async_writer(MyApplication* self);
+
+/**
+ * my_application_get_task_runner:
+ * @self: a #MyApplication.
+ *
+ * Gets the native worker pool. Plugins can reach it through
+ * g_application_get_default() and use it to move BLE, storage and analytics
+ * work off the platform thread, posting their results back with
+ * TaskRunner::PostResult().
+ *
+ * Returns: the application's #TaskRunner, or %NULL outside
+ * startup/shutdown.
+ */
+TaskRunner* my_application_get_task_runner(MyApplication* self);
+
 #endif  // FLUTTER_MY_APPLICATION_H_
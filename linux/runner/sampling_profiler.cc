@@ -0,0 +1,787 @@
+#include "sampling_profiler.h"
+
+#include <cxxabi.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <link.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+// Older glibc headers only expose the union member.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace {
+
+// Deepest stack recorded; deeper stacks are truncated at the root end.
+constexpr int kMaxFrames = 64;
+
+constexpr uint32_t kSlotEmpty = 0;
+constexpr uint32_t kSlotWriting = 1;
+constexpr uint32_t kSlotFull = 2;
+
+std::atomic<SamplingProfiler*> g_profiler{nullptr};
+std::atomic<int> g_handlers_running{0};
+
+// Read from the signal handler, so it must not need a lazy TLS allocation.
+thread_local const char* g_subsystem
+    __attribute__((tls_model("initial-exec"))) = nullptr;
+
+// SIGPROF belongs to the Dart VM's own profiler, so use a real-time signal.
+int ProfilerSignal() { return SIGRTMIN + 5; }
+
+pid_t CurrentTid() { return static_cast<pid_t>(syscall(SYS_gettid)); }
+
+// Opens a task-clock event on thread |tid| that overflows every |period_ns|
+// of its CPU time and signals the thread itself each time. Returns the event
+// fd, or -1.
+int OpenTaskClock(pid_t tid, uint64_t period_ns) {
+  struct perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;
+  attr.sample_period = period_ns;
+  attr.wakeup_events = 1;
+  // Required at perf_event_paranoid 2; time in the kernel is not sampled.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                                    PERF_FLAG_FD_CLOEXEC));
+  if (fd < 0) {
+    return -1;
+  }
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = tid;
+  if (fcntl(fd, F_SETOWN_EX, &owner) != 0 ||
+      fcntl(fd, F_SETSIG, ProfilerSignal()) != 0 ||
+      fcntl(fd, F_SETFL, O_ASYNC) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// The CPU-time clock of thread |tid|, as pthread_getcpuclockid() would return
+// for a pthread_t. Computing it from the tid works for threads this code did
+// not start.
+clockid_t ThreadCpuClock(pid_t tid) {
+  return static_cast<clockid_t>((~static_cast<unsigned>(tid) << 3) | 6);
+}
+
+// The registers of the interrupted code that the stack walk starts from.
+// |sp| and |fp| are zero where the architecture is not supported.
+struct InterruptedFrame {
+  uintptr_t pc = 0;
+  uintptr_t sp = 0;
+  uintptr_t fp = 0;
+};
+
+InterruptedFrame GetInterruptedFrame(void* context) {
+  const ucontext_t* uc = static_cast<const ucontext_t*>(context);
+  InterruptedFrame frame;
+#if defined(__x86_64__)
+  frame.pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+  frame.sp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]);
+  frame.fp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RBP]);
+#elif defined(__aarch64__)
+  frame.pc = static_cast<uintptr_t>(uc->uc_mcontext.pc);
+  frame.sp = static_cast<uintptr_t>(uc->uc_mcontext.sp);
+  frame.fp = static_cast<uintptr_t>(uc->uc_mcontext.regs[29]);
+#elif defined(__i386__)
+  frame.pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_EIP]);
+  frame.sp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_ESP]);
+  frame.fp = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_EBP]);
+#else
+  (void)uc;
+#endif
+  return frame;
+}
+
+// Follows the frame-pointer chain from |fp| and stores up to |max_frames|
+// return addresses in |frames|. Every supported ABI keeps a record of
+// {caller's frame pointer, return address} at the frame pointer. Only
+// [sp, stack_end) is read, and each record must lie above the last, so a
+// corrupt chain or a frame without a frame pointer ends the walk instead of
+// faulting. Returns the number of frames stored.
+int WalkFramePointers(uintptr_t fp, uintptr_t sp, uintptr_t stack_end,
+                      void** frames, int max_frames) {
+  const uintptr_t record_size = 2 * sizeof(uintptr_t);
+  uintptr_t lowest = sp;
+  int depth = 0;
+  while (depth < max_frames && fp >= lowest &&
+         fp % sizeof(uintptr_t) == 0 && stack_end - fp >= record_size) {
+    const uintptr_t* record = reinterpret_cast<const uintptr_t*>(fp);
+    uintptr_t caller_fp = record[0];
+    uintptr_t return_address = record[1];
+    if (return_address == 0) {
+      break;
+    }
+    frames[depth++] = reinterpret_cast<void*>(return_address);
+    lowest = fp + record_size;
+    fp = caller_fp;
+  }
+  return depth;
+}
+
+bool ReadThreadName(pid_t tid, std::string* name) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) {
+    return false;
+  }
+  char buffer[64];
+  bool ok = fgets(buffer, sizeof(buffer), file) != nullptr;
+  fclose(file);
+  if (!ok) {
+    return false;
+  }
+  buffer[strcspn(buffer, "\n")] = '\0';
+  *name = buffer;
+  return true;
+}
+
+bool StartsWith(const std::string& text, const char* prefix) {
+  return text.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Names a subsystem for samples without a ProfilerScope from the name of the
+// thread they were taken on.
+const char* GuessSubsystem(const std::string& thread_name, bool main_thread) {
+  if (main_thread) {
+    // The GTK main loop, the Flutter platform thread and every plugin.
+    return "platform";
+  }
+  if (StartsWith(thread_name, "1.") || StartsWith(thread_name, "io.worker")) {
+    return "flutter-engine";
+  }
+  if (StartsWith(thread_name, "Dart")) {
+    return "dart-vm";
+  }
+  if (thread_name == "gmain" || thread_name == "gdbus" ||
+      StartsWith(thread_name, "pool-")) {
+    return "glib";
+  }
+  if (StartsWith(thread_name, "runner-")) {
+    return "runner";
+  }
+  return "other";
+}
+
+// Folded stacks use ';' between frames and a space before the count; only
+// the former can't appear in a frame.
+void Sanitize(std::string* frame) {
+  for (char& c : *frame) {
+    if (c == ';' || c == '\n') {
+      c = ':';
+    }
+  }
+}
+
+// The function symbols in one module's .symtab, for naming functions that
+// are not exported and so are unknown to dladdr().
+class ElfSymbols {
+ public:
+  // Reads the symbols of the ELF file at |path|. The table is left empty if
+  // the file cannot be read or has been stripped.
+  explicit ElfSymbols(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+      return;
+    }
+    Load(static_cast<const char*>(data), info.st_size);
+    munmap(data, info.st_size);
+  }
+
+  // Returns the mangled name of the function that contains |address|, given
+  // in the file's own address space, or null.
+  const char* Find(uintptr_t address) const {
+    auto next = std::upper_bound(
+        symbols_.begin(), symbols_.end(), address,
+        [](uintptr_t a, const Symbol& symbol) { return a < symbol.address; });
+    if (next == symbols_.begin()) {
+      return nullptr;
+    }
+    const Symbol& symbol = *(next - 1);
+    if (address - symbol.address >= std::max<uintptr_t>(symbol.size, 1)) {
+      return nullptr;
+    }
+    return names_.data() + symbol.name;
+  }
+
+ private:
+  struct Symbol {
+    uintptr_t address;
+    uintptr_t size;
+    size_t name;
+  };
+
+  void Load(const char* data, size_t size) {
+    if (size < sizeof(ElfW(Ehdr))) {
+      return;
+    }
+    const ElfW(Ehdr)* header = reinterpret_cast<const ElfW(Ehdr)*>(data);
+#if __SIZEOF_POINTER__ == 8
+    const unsigned char elf_class = ELFCLASS64;
+#else
+    const unsigned char elf_class = ELFCLASS32;
+#endif
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+        header->e_ident[EI_CLASS] != elf_class ||
+        header->e_shentsize != sizeof(ElfW(Shdr)) ||
+        header->e_shoff > size ||
+        (size - header->e_shoff) / sizeof(ElfW(Shdr)) < header->e_shnum) {
+      return;
+    }
+    const ElfW(Shdr)* sections =
+        reinterpret_cast<const ElfW(Shdr)*>(data + header->e_shoff);
+    for (size_t i = 0; i < header->e_shnum; i++) {
+      const ElfW(Shdr)& table = sections[i];
+      if (table.sh_type != SHT_SYMTAB || table.sh_link >= header->e_shnum ||
+          table.sh_entsize != sizeof(ElfW(Sym))) {
+        continue;
+      }
+      const ElfW(Shdr)& strings = sections[table.sh_link];
+      if (table.sh_offset > size || table.sh_size > size - table.sh_offset ||
+          strings.sh_offset > size ||
+          strings.sh_size > size - strings.sh_offset) {
+        continue;
+      }
+      const ElfW(Sym)* symbols =
+          reinterpret_cast<const ElfW(Sym)*>(data + table.sh_offset);
+      const char* names = data + strings.sh_offset;
+      for (size_t j = 0; j < table.sh_size / sizeof(ElfW(Sym)); j++) {
+        const ElfW(Sym)& symbol = symbols[j];
+        // ST_TYPE is defined the same way for both ELF classes.
+        int type = ELF64_ST_TYPE(symbol.st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+            symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0 ||
+            symbol.st_name >= strings.sh_size) {
+          continue;
+        }
+        const char* name = names + symbol.st_name;
+        size_t length = strnlen(name, strings.sh_size - symbol.st_name);
+        symbols_.push_back({symbol.st_value, symbol.st_size, names_.size()});
+        names_.append(name, length);
+        names_ += '\0';
+      }
+    }
+    std::sort(symbols_.begin(), symbols_.end(),
+              [](const Symbol& a, const Symbol& b) {
+                return a.address < b.address;
+              });
+  }
+
+  std::vector<Symbol> symbols_;
+  std::string names_;
+};
+
+// Symbol tables read so far, by file path.
+using ModuleSymbols =
+    std::unordered_map<std::string, std::unique_ptr<ElfSymbols>>;
+
+// Names the function containing |pc|, looking in |modules| for functions that
+// are not exported. Frames in modules without a .symtab are named after the
+// module, so that samples in one stripped library still fold together.
+std::string Symbolize(uintptr_t pc, ModuleSymbols* modules) {
+  Dl_info info;
+  struct link_map* map = nullptr;
+  if (dladdr1(reinterpret_cast<void*>(pc), &info, reinterpret_cast<void**>(&map),
+              RTLD_DL_LINKMAP) == 0 ||
+      info.dli_fname == nullptr) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "0x%" PRIxPTR, pc);
+    return buffer;
+  }
+  const char* name = info.dli_sname;
+  if (name == nullptr && map != nullptr) {
+    // The main program's link map has an empty name.
+    std::string path = map->l_name[0] != '\0' ? map->l_name : "/proc/self/exe";
+    std::unique_ptr<ElfSymbols>& symbols = (*modules)[path];
+    if (symbols == nullptr) {
+      symbols.reset(new ElfSymbols(path.c_str()));
+    }
+    name = symbols->Find(pc - map->l_addr);
+  }
+
+  std::string symbol;
+  if (name != nullptr) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    symbol = status == 0 ? demangled : name;
+    free(demangled);
+  } else {
+    const char* module = strrchr(info.dli_fname, '/');
+    symbol = module != nullptr ? module + 1 : info.dli_fname;
+  }
+  Sanitize(&symbol);
+  return symbol;
+}
+
+}  // namespace
+
+struct SamplingProfiler::Slot {
+  std::atomic<uint32_t> state{kSlotEmpty};
+  pid_t tid;
+  int depth;
+  const char* subsystem;
+
+  // Innermost frame first. frames[0] is the interrupted instruction, the
+  // rest are return addresses.
+  void* frames[kMaxFrames];
+};
+
+// The process's writable mappings, which include every thread's stack, in
+// address order. The signal handler looks up the interrupted stack pointer
+// here to learn how far up the stack the frame-pointer walk may read. The
+// background thread rewrites the table under a sequence lock, so lookups
+// never block; a lookup that races a rewrite retries a few times and then
+// gives up rather than spin in a signal handler.
+//
+// New threads are only armed after the table has been re-read, so a stack
+// in use is always in it. The main thread's stack grows past its mapping,
+// and a process may exceed the table's capacity; a lookup that misses sets
+// |stale| so the table is re-read on the background thread's next pass, and
+// that sample keeps only its interrupted instruction.
+struct SamplingProfiler::StackRegions {
+  static constexpr size_t kCapacity = 8192;
+
+  // Odd while the table is being rewritten.
+  std::atomic<uint32_t> sequence{0};
+  std::atomic<size_t> count{0};
+  std::atomic<uintptr_t> begin[kCapacity];
+  std::atomic<uintptr_t> end[kCapacity];
+  std::atomic<bool> stale{false};
+
+  // Stores the end of the mapping containing |address| in |region_end|.
+  // Returns false if |address| is not in a listed mapping or the table is
+  // being rewritten.
+  bool Find(uintptr_t address, uintptr_t* region_end) const {
+    for (int attempt = 0; attempt < 4; attempt++) {
+      uint32_t before = sequence.load(std::memory_order_acquire);
+      if (before % 2 != 0) {
+        continue;
+      }
+      // Finds the first mapping that begins after |address|.
+      size_t low = 0;
+      size_t high = count.load(std::memory_order_relaxed);
+      while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (begin[middle].load(std::memory_order_relaxed) <= address) {
+          low = middle + 1;
+        } else {
+          high = middle;
+        }
+      }
+      uintptr_t found_end =
+          low > 0 ? end[low - 1].load(std::memory_order_relaxed) : 0;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence.load(std::memory_order_relaxed) != before) {
+        continue;
+      }
+      if (address >= found_end) {
+        return false;
+      }
+      *region_end = found_end;
+      return true;
+    }
+    return false;
+  }
+};
+
+ProfilerScope::ProfilerScope(const char* subsystem) : previous_(g_subsystem) {
+  g_subsystem = subsystem;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+ProfilerScope::~ProfilerScope() {
+  g_subsystem = previous_;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+constexpr int SamplingProfiler::kTypicalTickHz;
+
+SamplingProfiler::SamplingProfiler(const Options& options)
+    : options_(options) {}
+
+SamplingProfiler::~SamplingProfiler() { Stop(); }
+
+bool SamplingProfiler::Start() {
+  if (running_ || options_.frequency_hz <= 0 || options_.buffer_samples == 0) {
+    return false;
+  }
+  slots_.reset(new Slot[options_.buffer_samples]);
+  next_slot_ = 0;
+  dropped_ = 0;
+  drained_ = 0;
+
+  SamplingProfiler* expected = nullptr;
+  if (!g_profiler.compare_exchange_strong(expected, this)) {
+    return false;
+  }
+
+  backend_ = Backend::kCpuTimer;
+  if (!options_.force_cpu_timer) {
+    int fd = OpenTaskClock(CurrentTid(), 1000000000ULL);
+    if (fd >= 0) {
+      close(fd);
+      backend_ = Backend::kPerfEvent;
+    }
+  }
+
+  if (regions_ == nullptr) {
+    regions_.reset(new StackRegions());
+  }
+
+  // The handler stays installed after Stop(): a signal still queued from a
+  // closed source would otherwise kill the process.
+  struct sigaction action = {};
+  action.sa_sigaction = &SamplingProfiler::HandleSignal;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(ProfilerSignal(), &action, nullptr) != 0) {
+    g_profiler = nullptr;
+    return false;
+  }
+
+  stopping_ = false;
+  running_ = true;
+  collector_ = std::thread(&SamplingProfiler::CollectorMain, this);
+  return true;
+}
+
+void SamplingProfiler::Stop() {
+  if (!running_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stop_requested_.notify_all();
+  collector_.join();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& entry : sources_) {
+    DisarmThread(entry.second);
+  }
+  sources_.clear();
+  g_profiler = nullptr;
+  while (g_handlers_running > 0) {
+    sched_yield();
+  }
+  Drain();
+  running_ = false;
+}
+
+bool SamplingProfiler::WriteFolded(const std::string& path) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unordered_map<uintptr_t, std::string> symbols;
+  ModuleSymbols modules;
+  std::map<std::string, uint64_t> folded;
+  pid_t pid = getpid();
+
+  for (const auto& entry : stacks_) {
+    const std::string& key = entry.first;
+    pid_t tid;
+    const char* subsystem;
+    memcpy(&tid, key.data(), sizeof(tid));
+    memcpy(&subsystem, key.data() + sizeof(tid), sizeof(subsystem));
+    size_t frames_offset = sizeof(tid) + sizeof(subsystem);
+    size_t depth = (key.size() - frames_offset) / sizeof(void*);
+
+    std::string thread;
+    auto name = thread_names_.find(tid);
+    if (name != thread_names_.end()) {
+      thread = name->second;
+    } else {
+      thread = "thread-" + std::to_string(tid);
+    }
+    Sanitize(&thread);
+    std::string line = thread;
+    line += ';';
+    line += subsystem != nullptr ? subsystem
+                                 : GuessSubsystem(thread, tid == pid);
+
+    for (size_t i = depth; i-- > 0;) {
+      uintptr_t pc;
+      memcpy(&pc, key.data() + frames_offset + i * sizeof(pc), sizeof(pc));
+      // A return address points after the call; look up the call itself.
+      if (i > 0) {
+        pc--;
+      }
+      auto symbol = symbols.find(pc);
+      if (symbol == symbols.end()) {
+        symbol = symbols.emplace(pc, Symbolize(pc, &modules)).first;
+      }
+      line += ';';
+      line += symbol->second;
+    }
+    folded[line] += entry.second;
+  }
+
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+  for (const auto& entry : folded) {
+    fprintf(file, "%s %" PRIu64 "\n", entry.first.c_str(), entry.second);
+  }
+  return fclose(file) == 0;
+}
+
+SamplingProfiler::Stats SamplingProfiler::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  stats.samples = samples_;
+  stats.dropped = dropped_;
+  stats.threads = thread_names_.size();
+  stats.stacks = stacks_.size();
+  stats.collector_seconds = collector_seconds_;
+  return stats;
+}
+
+void SamplingProfiler::HandleSignal(int signal, siginfo_t* info,
+                                    void* context) {
+  int saved_errno = errno;
+  g_handlers_running++;
+  SamplingProfiler* profiler = g_profiler;
+  if (profiler != nullptr) {
+    profiler->Record(context);
+  }
+  g_handlers_running--;
+  errno = saved_errno;
+}
+
+void SamplingProfiler::Record(void* context) {
+  InterruptedFrame interrupted = GetInterruptedFrame(context);
+  uint64_t index = next_slot_.fetch_add(1, std::memory_order_relaxed) %
+                   options_.buffer_samples;
+  Slot& slot = slots_[index];
+  uint32_t expected = kSlotEmpty;
+  if (!slot.state.compare_exchange_strong(expected, kSlotWriting,
+                                          std::memory_order_acquire)) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  slot.frames[0] = reinterpret_cast<void*>(interrupted.pc);
+  slot.depth = 1;
+  uintptr_t stack_end;
+  if (regions_->Find(interrupted.sp, &stack_end)) {
+    slot.depth += WalkFramePointers(interrupted.fp, interrupted.sp, stack_end,
+                                    slot.frames + 1, kMaxFrames - 1);
+  } else if (interrupted.sp != 0) {
+    regions_->stale.store(true, std::memory_order_relaxed);
+  }
+  slot.tid = CurrentTid();
+  slot.subsystem = g_subsystem;
+  slot.state.store(kSlotFull, std::memory_order_release);
+}
+
+void SamplingProfiler::CollectorMain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  collector_tid_ = CurrentTid();
+  while (!stopping_) {
+    // On one CPU every wake-up is taken from the threads being profiled, so
+    // new threads are picked up and the buffer drained on the same 200 ms
+    // pass.
+    RefreshThreads();
+    Drain();
+    stop_requested_.wait_for(lock, std::chrono::milliseconds(200),
+                             [this] { return stopping_; });
+  }
+
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  collector_seconds_ += cpu.tv_sec + cpu.tv_nsec / 1e9;
+}
+
+void SamplingProfiler::RefreshThreads() {
+  DIR* tasks = opendir("/proc/self/task");
+  if (tasks == nullptr) {
+    return;
+  }
+  std::vector<pid_t> tids;
+  bool new_threads = false;
+  while (struct dirent* entry = readdir(tasks)) {
+    pid_t tid = static_cast<pid_t>(atoi(entry->d_name));
+    if (tid <= 0 || tid == collector_tid_) {
+      continue;
+    }
+    auto existing = sources_.find(tid);
+    if (existing == sources_.end() || !existing->second.named) {
+      // Threads often name themselves just after they start, so the name is
+      // read again on the pass after the thread was armed, and then kept.
+      std::string name;
+      if (!ReadThreadName(tid, &name)) {
+        continue;
+      }
+      thread_names_[tid] = name;
+      if (existing != sources_.end()) {
+        existing->second.named = true;
+      }
+    }
+    tids.push_back(tid);
+    new_threads = new_threads || existing == sources_.end();
+  }
+  closedir(tasks);
+
+  // A new thread's stack must be in the table before it is first sampled.
+  if (new_threads || regions_->stale.load(std::memory_order_relaxed)) {
+    RefreshStackRegions();
+  }
+
+  std::map<pid_t, ThreadSource> live;
+  for (pid_t tid : tids) {
+    auto existing = sources_.find(tid);
+    if (existing != sources_.end()) {
+      live[tid] = existing->second;
+      sources_.erase(existing);
+      continue;
+    }
+    ThreadSource source;
+    if (ArmThread(tid, &source)) {
+      live[tid] = source;
+    }
+  }
+
+  // Whatever is left belongs to threads that have exited.
+  for (const auto& entry : sources_) {
+    DisarmThread(entry.second);
+  }
+  sources_.swap(live);
+}
+
+void SamplingProfiler::RefreshStackRegions() {
+  FILE* maps = fopen("/proc/self/maps", "re");
+  if (maps == nullptr) {
+    return;
+  }
+  // Clear the flag first, so a miss during the read asks for another pass.
+  regions_->stale.store(false, std::memory_order_relaxed);
+  std::vector<std::pair<uintptr_t, uintptr_t>> regions;
+  char* line = nullptr;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, maps) > 0) {
+    uintptr_t begin;
+    uintptr_t end;
+    char permissions[5];
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s", &begin, &end,
+               permissions) == 3 &&
+        permissions[0] == 'r' && permissions[1] == 'w') {
+      regions.emplace_back(begin, end);
+    }
+  }
+  free(line);
+  fclose(maps);
+
+  // The kernel lists mappings in address order. Past the capacity, the
+  // highest mappings are left out.
+  StackRegions& table = *regions_;
+  size_t count = regions.size();
+  if (count > StackRegions::kCapacity) {
+    count = StackRegions::kCapacity;
+  }
+  uint32_t sequence = table.sequence.load(std::memory_order_relaxed);
+  table.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < count; i++) {
+    table.begin[i].store(regions[i].first, std::memory_order_relaxed);
+    table.end[i].store(regions[i].second, std::memory_order_relaxed);
+  }
+  table.count.store(count, std::memory_order_relaxed);
+  table.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool SamplingProfiler::ArmThread(pid_t tid, ThreadSource* source) const {
+  uint64_t period_ns = 1000000000ULL / options_.frequency_hz;
+  if (backend_ == Backend::kPerfEvent) {
+    source->perf_fd = OpenTaskClock(tid, period_ns);
+    return source->perf_fd >= 0;
+  }
+
+  struct sigevent event = {};
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = ProfilerSignal();
+  event.sigev_notify_thread_id = tid;
+  if (timer_create(ThreadCpuClock(tid), &event, &source->timer) != 0) {
+    // The thread exited after it was listed.
+    return false;
+  }
+  struct itimerspec spec = {};
+  spec.it_interval.tv_sec = period_ns / 1000000000ULL;
+  spec.it_interval.tv_nsec = period_ns % 1000000000ULL;
+  spec.it_value = spec.it_interval;
+  if (timer_settime(source->timer, 0, &spec, nullptr) != 0) {
+    timer_delete(source->timer);
+    return false;
+  }
+  return true;
+}
+
+void SamplingProfiler::DisarmThread(const ThreadSource& source) const {
+  if (source.perf_fd >= 0) {
+    close(source.perf_fd);
+  } else {
+    timer_delete(source.timer);
+  }
+}
+
+void SamplingProfiler::Drain() {
+  // Only visit the slots claimed since the last drain. Slots are large and
+  // scattered, so scanning all of them on every pass would cost more than the
+  // sampling itself.
+  size_t capacity = options_.buffer_samples;
+  uint64_t end = next_slot_.load(std::memory_order_acquire);
+  uint64_t begin = end - drained_ > capacity ? end - capacity : drained_;
+  uint64_t resume = end;
+  std::string key;
+  for (uint64_t i = begin; i < end; i++) {
+    Slot& slot = slots_[i % capacity];
+    uint32_t state = slot.state.load(std::memory_order_acquire);
+    if (state == kSlotWriting) {
+      // Interrupted mid-copy on another CPU; pick it up next time.
+      resume = std::min(resume, i);
+      continue;
+    }
+    if (state != kSlotFull) {
+      continue;
+    }
+    key.assign(reinterpret_cast<const char*>(&slot.tid), sizeof(slot.tid));
+    key.append(reinterpret_cast<const char*>(&slot.subsystem),
+               sizeof(slot.subsystem));
+    key.append(reinterpret_cast<const char*>(slot.frames),
+               slot.depth * sizeof(void*));
+    stacks_[key]++;
+    samples_++;
+    slot.state.store(kSlotEmpty, std::memory_order_release);
+  }
+  drained_ = resume;
+}
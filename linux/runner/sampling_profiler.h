@@ -0,0 +1,188 @@
+#ifndef RUNNER_SAMPLING_PROFILER_H_
+#define RUNNER_SAMPLING_PROFILER_H_
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Tags the samples the profiler takes on the calling thread with |subsystem|
+// until the scope ends. Scopes nest. Costs a thread-local store, so it can be
+// left in place when the profiler is not running. |subsystem| must be a
+// string literal or otherwise outlive the profiler.
+class ProfilerScope {
+ public:
+  explicit ProfilerScope(const char* subsystem);
+  ~ProfilerScope();
+
+  ProfilerScope(const ProfilerScope&) = delete;
+  ProfilerScope& operator=(const ProfilerScope&) = delete;
+
+ private:
+  const char* previous_;
+};
+
+// Samples the call stacks of every thread in the process and writes them in
+// the folded format used by flame graph tools:
+//
+//   <thread>;<subsystem>;<outermost frame>;...;<innermost frame> <count>
+//
+// Each thread gets its own sampling source that signals it after every
+// 1/frequency seconds of CPU it consumes, so idle threads cost nothing and
+// busy ones are sampled in proportion to their CPU use. The source is a
+// perf_event_open() task-clock event; where perf events are not permitted
+// (perf_event_paranoid > 2) it falls back to a POSIX timer on the thread's
+// CPU-time clock, which the kernel only checks once per scheduler tick and
+// so samples at no more than CONFIG_HZ.
+//
+// The signal handler walks the interrupted thread's frame-pointer chain into
+// a preallocated buffer. It takes no locks and reads no memory outside the
+// thread's stack, whose bounds come from a table of writable mappings that
+// the background thread keeps current, so it is safe wherever the thread
+// was interrupted, including inside the unwinder or the dynamic loader.
+// Code built without frame pointers loses callers: the walk skips or stops
+// at its frames. The runner is built with -fno-omit-frame-pointer for this.
+// Even then a leaf function that needs no stack frame, or one interrupted in
+// its prologue, has not pushed a frame, so its caller is missing from the
+// stack and its samples attach to the caller's caller.
+// The background thread also drains the buffer, aggregates identical stacks
+// and picks up threads started after Start(), such as the Flutter engine's.
+//
+// Samples are tagged with the innermost ProfilerScope on their thread, or,
+// without one, with a subsystem guessed from the thread's name. Frames are
+// named from the dynamic symbol table or, failing that, the module's .symtab.
+// Frames in stripped modules are collapsed to the module's name.
+//
+// Only one profiler can run at a time.
+class SamplingProfiler {
+ public:
+  enum class Backend {
+    kPerfEvent,
+    kCpuTimer,
+  };
+
+  // The usual scheduler tick rate, and so the usual ceiling of the CPU-timer
+  // backend. The kernel's CONFIG_HZ is not visible to user space; 250 is the
+  // common distribution setting, and some kernels use 100 or 1000.
+  static constexpr int kTypicalTickHz = 250;
+
+  struct Options {
+    // Samples per second of CPU time, per thread.
+    int frequency_hz = 1000;
+
+    // Samples buffered between drains, which run every 200 ms: enough for
+    // 20 busy threads at 1 kHz. Samples taken while the buffer is full are
+    // dropped.
+    size_t buffer_samples = 4096;
+
+    // Uses CPU-time timers even when perf events are available.
+    bool force_cpu_timer = false;
+  };
+
+  struct Stats {
+    uint64_t samples = 0;
+    uint64_t dropped = 0;
+
+    // Threads sampled and distinct stacks recorded.
+    size_t threads = 0;
+    size_t stacks = 0;
+
+    // CPU time used by the background thread, summed over every run.
+    double collector_seconds = 0;
+  };
+
+  explicit SamplingProfiler(const Options& options);
+  ~SamplingProfiler();
+
+  SamplingProfiler(const SamplingProfiler&) = delete;
+  SamplingProfiler& operator=(const SamplingProfiler&) = delete;
+
+  // Starts sampling. Returns false if the signal handler could not be
+  // installed or another profiler is running.
+  bool Start();
+
+  // Stops sampling and collects the remaining samples.
+  void Stop();
+
+  // Writes the samples collected so far to |path| in folded-stack format.
+  // Returns true on success.
+  bool WriteFolded(const std::string& path) const;
+
+  Backend backend() const { return backend_; }
+
+  Stats GetStats() const;
+
+ private:
+  struct Slot;
+  struct StackRegions;
+
+  // The sampling source of one thread: a perf event or a timer.
+  struct ThreadSource {
+    int perf_fd = -1;
+    timer_t timer = timer_t();
+
+    // Whether the thread's name has been read on a pass after the one that
+    // armed it, and so is no longer re-read.
+    bool named = false;
+  };
+
+  static void HandleSignal(int signal, siginfo_t* info, void* context);
+
+  // Copies the calling thread's stack, interrupted with signal |context|,
+  // into a free slot.
+  void Record(void* context);
+
+  // Runs on the background thread until Stop().
+  void CollectorMain();
+
+  // Starts sampling threads that have appeared since the last call and stops
+  // sampling those that have exited.
+  void RefreshThreads();
+
+  // Re-reads the writable mappings into |regions_|.
+  void RefreshStackRegions();
+
+  bool ArmThread(pid_t tid, ThreadSource* source) const;
+  void DisarmThread(const ThreadSource& source) const;
+
+  // Moves the slots filled since the last call into |stacks_|.
+  void Drain();
+
+  Options options_;
+  Backend backend_ = Backend::kPerfEvent;
+  std::unique_ptr<Slot[]> slots_;
+  std::unique_ptr<StackRegions> regions_;
+  std::atomic<uint64_t> next_slot_{0};
+  std::atomic<uint64_t> dropped_{0};
+
+  // Slot claims before this one have been drained, except for the slots
+  // dropped because they were full.
+  uint64_t drained_ = 0;
+
+  std::thread collector_;
+  pid_t collector_tid_ = 0;
+  mutable std::mutex mutex_;
+  std::condition_variable stop_requested_;
+  bool stopping_ = false;
+  bool running_ = false;
+
+  // Guarded by |mutex_| once Start() has been called.
+  std::map<pid_t, ThreadSource> sources_;
+  std::map<pid_t, std::string> thread_names_;
+  std::unordered_map<std::string, uint64_t> stacks_;
+  uint64_t samples_ = 0;
+  double collector_seconds_ = 0;
+};
+
+#endif  // RUNNER_SAMPLING_PROFILER_H_
@@ -0,0 +1,139 @@
+#include "scan_filter.h"
+
+#include <string.h>
+
+namespace {
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+}  // namespace
+
+bool ParseServiceUuid(const std::string& text, ServiceUuid* uuid) {
+  if (text.size() != 36) {
+    return false;
+  }
+  size_t byte = 0;
+  for (size_t i = 0; i < text.size();) {
+    if (i == 8 || i == 13 || i == 18 || i == 23) {
+      if (text[i] != '-') {
+        return false;
+      }
+      i++;
+      continue;
+    }
+    int high = HexValue(text[i]);
+    int low = HexValue(text[i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    uuid->bytes[byte++] = static_cast<uint8_t>(high << 4 | low);
+    i += 2;
+  }
+  return byte == sizeof(uuid->bytes);
+}
+
+AdvertisementFilter::AdvertisementFilter(const Options& options)
+    : options_(options) {}
+
+AdvertisementFilter::~AdvertisementFilter() {}
+
+AdvertisementFilter::Verdict AdvertisementFilter::Add(
+    const Advertisement& advertisement) {
+  stats_.received++;
+  if (advertisement.rssi < options_.min_rssi || !Matches(advertisement)) {
+    stats_.rejected++;
+    return Verdict::kRejected;
+  }
+
+  auto inserted = candidates_.emplace(advertisement.address, Candidate());
+  Candidate& candidate = inserted.first->second;
+  if (inserted.second) {
+    candidate.address = advertisement.address;
+    candidate.smoothed_rssi = advertisement.rssi;
+    candidate.first_seen_ms = advertisement.timestamp_ms;
+  } else {
+    if (advertisement.timestamp_ms - candidate.last_seen_ms <
+        options_.duplicate_window_ms) {
+      stats_.duplicates++;
+      return Verdict::kDuplicate;
+    }
+    candidate.smoothed_rssi +=
+        options_.rssi_smoothing * (advertisement.rssi - candidate.smoothed_rssi);
+  }
+  candidate.sightings++;
+  candidate.last_seen_ms = advertisement.timestamp_ms;
+  stats_.accepted++;
+
+  if (selected_ != nullptr) {
+    return Verdict::kAccepted;
+  }
+  Rank(&candidate);
+  return selected_ != nullptr ? Verdict::kSelected : Verdict::kAccepted;
+}
+
+const AdvertisementFilter::Candidate* AdvertisementFilter::Best() const {
+  return selected_ != nullptr ? selected_ : best_;
+}
+
+void AdvertisementFilter::Reset() {
+  candidates_.clear();
+  best_ = nullptr;
+  selected_ = nullptr;
+  stats_ = Stats();
+}
+
+bool AdvertisementFilter::Matches(const Advertisement& advertisement) const {
+  const std::string& prefix = options_.name_prefix;
+  if (!prefix.empty() && advertisement.name_length >= prefix.size() &&
+      memcmp(advertisement.name, prefix.data(), prefix.size()) == 0) {
+    return true;
+  }
+  // The app wants one or two services, so comparing each listed UUID against
+  // them directly is cheaper than hashing it first.
+  for (size_t i = 0; i < advertisement.service_uuid_count; i++) {
+    const ServiceUuid& uuid = advertisement.service_uuids[i];
+    for (const ServiceUuid& wanted : options_.service_uuids) {
+      if (memcmp(uuid.bytes, wanted.bytes, sizeof(uuid.bytes)) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void AdvertisementFilter::Rank(const Candidate* updated) {
+  // Only matching devices are stored, so there are few candidates and a
+  // linear pass is cheaper than keeping them ordered.
+  const Candidate* best = nullptr;
+  const Candidate* runner_up = nullptr;
+  for (const auto& entry : candidates_) {
+    const Candidate* candidate = &entry.second;
+    if (best == nullptr || candidate->smoothed_rssi > best->smoothed_rssi) {
+      runner_up = best;
+      best = candidate;
+    } else if (runner_up == nullptr ||
+               candidate->smoothed_rssi > runner_up->smoothed_rssi) {
+      runner_up = candidate;
+    }
+  }
+  best_ = best;
+
+  if (best != updated || best->sightings < options_.min_sightings) {
+    return;
+  }
+  if (runner_up == nullptr ||
+      best->smoothed_rssi - runner_up->smoothed_rssi >= options_.min_margin_db) {
+    selected_ = best;
+  }
+}
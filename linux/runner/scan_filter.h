@@ -0,0 +1,130 @@
+#ifndef RUNNER_SCAN_FILTER_H_
+#define RUNNER_SCAN_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A 128-bit service UUID in textual (big-endian) byte order.
+struct ServiceUuid {
+  uint8_t bytes[16];
+};
+
+// Parses "12345678-1234-5678-1234-56789abcdef0" into |uuid|. Returns false if
+// |text| is not a UUID.
+bool ParseServiceUuid(const std::string& text, ServiceUuid* uuid);
+
+// One advertising report as delivered by the controller.
+struct Advertisement {
+  // The 48-bit device address.
+  uint64_t address;
+  int8_t rssi;
+  int64_t timestamp_ms;
+
+  // The local name, not NUL-terminated. May be empty.
+  const char* name;
+  size_t name_length;
+
+  const ServiceUuid* service_uuids;
+  size_t service_uuid_count;
+};
+
+// Picks the sofa to connect to out of a stream of advertisements, so a scan
+// can stop as soon as the choice is clear instead of after a fixed timeout.
+//
+// Reports that match neither the wanted services nor the name prefix are
+// rejected before any lookup and never stored, so the cost of a report from
+// an unrelated device does not grow with the number of devices nearby.
+// Matching devices are ranked by exponentially smoothed RSSI.
+//
+// The app applies the same ranking policy in lib/scan_selector.dart
+// (ScanSelector). The defaults below must match its constants.
+class AdvertisementFilter {
+ public:
+  struct Options {
+    // A report matches if it lists any of these services...
+    std::vector<ServiceUuid> service_uuids;
+
+    // ...or its name starts with this prefix. Empty matches no names.
+    std::string name_prefix;
+
+    // Reports from a device within this long of its last accepted report are
+    // dropped as duplicates.
+    int64_t duplicate_window_ms = 100;
+
+    // Weight of each new RSSI reading in the smoothed value.
+    double rssi_smoothing = 0.3;
+
+    // Matching devices weaker than this are ignored.
+    int min_rssi = -95;
+
+    // A device is selected once it has been seen this many times...
+    uint32_t min_sightings = 3;
+
+    // ...and its smoothed RSSI leads every other match by this margin.
+    double min_margin_db = 6;
+  };
+
+  struct Candidate {
+    uint64_t address = 0;
+    double smoothed_rssi = 0;
+    uint32_t sightings = 0;
+    int64_t first_seen_ms = 0;
+    int64_t last_seen_ms = 0;
+  };
+
+  enum class Verdict {
+    // Does not match the options.
+    kRejected,
+    // Matches, but arrived inside the duplicate window.
+    kDuplicate,
+    // Matches and updated its candidate.
+    kAccepted,
+    // Matches, and this report made its candidate the confident choice.
+    kSelected,
+  };
+
+  struct Stats {
+    uint64_t received = 0;
+    uint64_t rejected = 0;
+    uint64_t duplicates = 0;
+    uint64_t accepted = 0;
+  };
+
+  explicit AdvertisementFilter(const Options& options);
+  ~AdvertisementFilter();
+
+  // Processes one advertising report.
+  Verdict Add(const Advertisement& advertisement);
+
+  // Returns true once a candidate has been selected.
+  bool has_selection() const { return selected_ != nullptr; }
+
+  // The selected candidate, or the strongest one so far when nothing has been
+  // selected yet (e.g. when the caller's own timeout expires). Returns null
+  // when no device has matched.
+  const Candidate* Best() const;
+
+  // Forgets every candidate and the selection, for a new scan.
+  void Reset();
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  bool Matches(const Advertisement& advertisement) const;
+
+  // Re-ranks after |updated| changed, updating |best_| and |selected_|.
+  void Rank(const Candidate* updated);
+
+  Options options_;
+
+  std::unordered_map<uint64_t, Candidate> candidates_;
+  const Candidate* best_ = nullptr;
+  const Candidate* selected_ = nullptr;
+  Stats stats_;
+};
+
+#endif  // RUNNER_SCAN_FILTER_H_
@@ -0,0 +1,261 @@
+#include "sensor_history.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char kFileMagic[8] = {'S', 'O', 'F', 'A', 'H', 'I', 'S', 'T'};
+constexpr uint32_t kFileVersion = 1;
+constexpr uint32_t kSegmentMagic = 0x4d474553;  // "SEGM"
+
+// On-disk layout of a segment header, padded to kSegmentHeaderSize.
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t sample_count;
+  int64_t first_timestamp_ms;
+  int64_t last_timestamp_ms;
+  float min[kSensorFieldCount];
+  float max[kSensorFieldCount];
+  uint8_t padding[16];
+};
+
+static_assert(sizeof(SegmentHeader) == kSegmentHeaderSize,
+              "segment header must fill its slot exactly");
+static_assert(sizeof(SensorSample) == 24, "sample layout is part of the format");
+
+// Reads exactly |size| bytes at |offset|. Returns false on error or EOF.
+bool PreadFully(int fd, void* buffer, size_t size, int64_t offset) {
+  char* out = static_cast<char*>(buffer);
+  while (size > 0) {
+    ssize_t result = pread(fd, out, size, offset);
+    if (result <= 0) {
+      return false;
+    }
+    out += result;
+    size -= result;
+    offset += result;
+  }
+  return true;
+}
+
+// Writes exactly |size| bytes at |offset|. Returns false on error.
+bool PwriteFully(int fd, const void* buffer, size_t size, int64_t offset) {
+  const char* in = static_cast<const char*>(buffer);
+  while (size > 0) {
+    ssize_t result = pwrite(fd, in, size, offset);
+    if (result < 0) {
+      return false;
+    }
+    in += result;
+    size -= result;
+    offset += result;
+  }
+  return true;
+}
+
+// Returns the number of segments in a history file of |file_size| bytes.
+size_t SegmentCountForSize(int64_t file_size) {
+  if (file_size <= static_cast<int64_t>(kHistoryFileHeaderSize)) {
+    return 0;
+  }
+  int64_t body = file_size - kHistoryFileHeaderSize;
+  return static_cast<size_t>((body + kSegmentSize - 1) / kSegmentSize);
+}
+
+bool ReadHeader(int fd, size_t index, SegmentHeader* header) {
+  if (!PreadFully(fd, header, sizeof(*header), SegmentOffset(index))) {
+    return false;
+  }
+  // A segment whose first sample has been written but whose header has not
+  // yet been updated is empty.
+  if (header->magic != kSegmentMagic) {
+    memset(header, 0, sizeof(*header));
+  }
+  return header->sample_count <= kSegmentCapacity;
+}
+
+}  // namespace
+
+SensorHistoryWriter::SensorHistoryWriter() {}
+
+SensorHistoryWriter::~SensorHistoryWriter() { Close(); }
+
+bool SensorHistoryWriter::Open(const std::string& path) {
+  Close();
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd_, &info) != 0) {
+    Close();
+    return false;
+  }
+
+  char file_header[kHistoryFileHeaderSize] = {};
+  if (info.st_size == 0) {
+    memcpy(file_header, kFileMagic, sizeof(kFileMagic));
+    memcpy(file_header + sizeof(kFileMagic), &kFileVersion,
+           sizeof(kFileVersion));
+    if (!PwriteFully(fd_, file_header, sizeof(file_header), 0)) {
+      Close();
+      return false;
+    }
+    segment_index_ = 0;
+    summary_ = {};
+    return true;
+  }
+
+  uint32_t version = 0;
+  if (!PreadFully(fd_, file_header, sizeof(file_header), 0) ||
+      memcmp(file_header, kFileMagic, sizeof(kFileMagic)) != 0) {
+    Close();
+    return false;
+  }
+  memcpy(&version, file_header + sizeof(kFileMagic), sizeof(version));
+  if (version != kFileVersion) {
+    Close();
+    return false;
+  }
+
+  size_t count = SegmentCountForSize(info.st_size);
+  segment_index_ = count == 0 ? 0 : count - 1;
+  summary_ = {};
+  if (count > 0) {
+    SegmentHeader header;
+    if (!ReadHeader(fd_, segment_index_, &header)) {
+      Close();
+      return false;
+    }
+    summary_.first_timestamp_ms = header.first_timestamp_ms;
+    summary_.last_timestamp_ms = header.last_timestamp_ms;
+    summary_.sample_count = header.sample_count;
+    memcpy(summary_.min, header.min, sizeof(summary_.min));
+    memcpy(summary_.max, header.max, sizeof(summary_.max));
+  }
+  return true;
+}
+
+bool SensorHistoryWriter::Append(const SensorSample& sample) {
+  if (fd_ < 0) {
+    return false;
+  }
+  if (summary_.sample_count == kSegmentCapacity) {
+    segment_index_++;
+    summary_ = {};
+  }
+
+  if (summary_.sample_count == 0) {
+    summary_.first_timestamp_ms = sample.timestamp_ms;
+    for (int field = 0; field < kSensorFieldCount; field++) {
+      summary_.min[field] = sample.values[field];
+      summary_.max[field] = sample.values[field];
+    }
+  } else {
+    for (int field = 0; field < kSensorFieldCount; field++) {
+      if (sample.values[field] < summary_.min[field]) {
+        summary_.min[field] = sample.values[field];
+      }
+      if (sample.values[field] > summary_.max[field]) {
+        summary_.max[field] = sample.values[field];
+      }
+    }
+  }
+  summary_.last_timestamp_ms = sample.timestamp_ms;
+
+  // The sample goes down before the header that makes it visible, so readers
+  // never see a count that covers unwritten data.
+  int64_t offset = SegmentOffset(segment_index_) + kSegmentHeaderSize +
+                   summary_.sample_count * sizeof(SensorSample);
+  if (!PwriteFully(fd_, &sample, sizeof(sample), offset)) {
+    return false;
+  }
+  summary_.sample_count++;
+  return WriteSegmentHeader();
+}
+
+void SensorHistoryWriter::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool SensorHistoryWriter::WriteSegmentHeader() {
+  SegmentHeader header = {};
+  header.magic = kSegmentMagic;
+  header.sample_count = summary_.sample_count;
+  header.first_timestamp_ms = summary_.first_timestamp_ms;
+  header.last_timestamp_ms = summary_.last_timestamp_ms;
+  memcpy(header.min, summary_.min, sizeof(header.min));
+  memcpy(header.max, summary_.max, sizeof(header.max));
+  return PwriteFully(fd_, &header, sizeof(header),
+                     SegmentOffset(segment_index_));
+}
+
+SensorHistoryReader::SensorHistoryReader() {}
+
+SensorHistoryReader::~SensorHistoryReader() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool SensorHistoryReader::Open(const std::string& path) {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    return false;
+  }
+  char file_header[kHistoryFileHeaderSize];
+  if (!PreadFully(fd_, file_header, sizeof(file_header), 0) ||
+      memcmp(file_header, kFileMagic, sizeof(kFileMagic)) != 0) {
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+size_t SensorHistoryReader::SegmentCount() const {
+  struct stat info;
+  if (fd_ < 0 || fstat(fd_, &info) != 0) {
+    return 0;
+  }
+  return SegmentCountForSize(info.st_size);
+}
+
+bool SensorHistoryReader::ReadSummary(size_t index,
+                                      SegmentSummary* summary) const {
+  SegmentHeader header;
+  if (fd_ < 0 || !ReadHeader(fd_, index, &header)) {
+    return false;
+  }
+  summary->first_timestamp_ms = header.first_timestamp_ms;
+  summary->last_timestamp_ms = header.last_timestamp_ms;
+  summary->sample_count = header.sample_count;
+  memcpy(summary->min, header.min, sizeof(summary->min));
+  memcpy(summary->max, header.max, sizeof(summary->max));
+  return true;
+}
+
+bool SensorHistoryReader::ReadSamples(size_t index,
+                                      std::vector<SensorSample>* samples) const {
+  SegmentHeader header;
+  if (fd_ < 0 || !ReadHeader(fd_, index, &header)) {
+    return false;
+  }
+  samples->resize(header.sample_count);
+  if (header.sample_count == 0) {
+    return true;
+  }
+  return PreadFully(fd_, samples->data(),
+                    header.sample_count * sizeof(SensorSample),
+                    SegmentOffset(index) + kSegmentHeaderSize);
+}
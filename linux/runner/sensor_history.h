@@ -0,0 +1,117 @@
+#ifndef RUNNER_SENSOR_HISTORY_H_
+#define RUNNER_SENSOR_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// The readings the sofa notifies on the sensor characteristic.
+enum SensorField {
+  kSensorTemperature = 0,
+  kSensorHumidity = 1,
+  kSensorPpm = 2,
+  kSensorFieldCount = 3,
+};
+
+// One "temperature,humidity,ppm" notification as stored on disk.
+struct SensorSample {
+  int64_t timestamp_ms;
+  float values[kSensorFieldCount];
+  uint32_t reserved;
+};
+
+// Per-segment block statistics. Stored in every segment header so that scans
+// can decide whether a segment can match without reading its samples.
+struct SegmentSummary {
+  int64_t first_timestamp_ms;
+  int64_t last_timestamp_ms;
+  uint32_t sample_count;
+  float min[kSensorFieldCount];
+  float max[kSensorFieldCount];
+};
+
+// Number of samples in a full segment. Segments are fixed size on disk so the
+// offset of segment |i| can be computed without an index.
+constexpr uint32_t kSegmentCapacity = 4096;
+
+// Size in bytes of the header that precedes the samples of each segment.
+constexpr size_t kSegmentHeaderSize = 64;
+
+// Size in bytes of the file header at the start of every history file.
+constexpr size_t kHistoryFileHeaderSize = 16;
+
+// Size in bytes of one segment on disk, header included.
+constexpr size_t kSegmentSize =
+    kSegmentHeaderSize + kSegmentCapacity * sizeof(SensorSample);
+
+// Returns the file offset of segment |index|.
+constexpr int64_t SegmentOffset(size_t index) {
+  return static_cast<int64_t>(kHistoryFileHeaderSize + index * kSegmentSize);
+}
+
+// Appends samples for a single device to its history file. Samples must be
+// appended in timestamp order. Not thread safe.
+class SensorHistoryWriter {
+ public:
+  SensorHistoryWriter();
+  ~SensorHistoryWriter();
+
+  SensorHistoryWriter(const SensorHistoryWriter&) = delete;
+  SensorHistoryWriter& operator=(const SensorHistoryWriter&) = delete;
+
+  // Opens |path| for appending, creating it if it does not exist. Returns true
+  // on success.
+  bool Open(const std::string& path);
+
+  // Appends |sample| to the open segment, starting a new segment when the
+  // current one is full. Returns true on success.
+  bool Append(const SensorSample& sample);
+
+  // Closes the file. Called automatically on destruction.
+  void Close();
+
+ private:
+  // Writes the header of the open segment.
+  bool WriteSegmentHeader();
+
+  int fd_ = -1;
+
+  // Index of the segment currently being appended to.
+  size_t segment_index_ = 0;
+
+  // Summary of the segment currently being appended to.
+  SegmentSummary summary_ = {};
+};
+
+// Random access to a device history file. All methods are safe to call from
+// multiple threads at once.
+class SensorHistoryReader {
+ public:
+  SensorHistoryReader();
+  ~SensorHistoryReader();
+
+  SensorHistoryReader(const SensorHistoryReader&) = delete;
+  SensorHistoryReader& operator=(const SensorHistoryReader&) = delete;
+
+  // Opens |path| for reading. Returns true on success.
+  bool Open(const std::string& path);
+
+  // Returns the number of segments currently in the file, including a
+  // partially filled last segment.
+  size_t SegmentCount() const;
+
+  // Reads the block statistics of segment |index| into |summary|. Returns true
+  // on success.
+  bool ReadSummary(size_t index, SegmentSummary* summary) const;
+
+  // Replaces the contents of |samples| with the samples of segment |index|.
+  // Returns true on success.
+  bool ReadSamples(size_t index, std::vector<SensorSample>* samples) const;
+
+ private:
+  int fd_ = -1;
+};
+
+#endif  // RUNNER_SENSOR_HISTORY_H_
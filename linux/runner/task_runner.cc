@@ -0,0 +1,236 @@
+#include "task_runner.h"
+
+#include <string>
+
+#include "sampling_profiler.h"
+
+struct TaskRunner::Worker {
+  GMainContext* context;
+  GMainLoop* loop;
+  GThread* thread;
+
+  // Guards the fields below.
+  std::mutex mutex;
+  bool stopped = false;
+  uint64_t posted = 0;
+  uint64_t completed = 0;
+  uint64_t expired = 0;
+  LatencyHistogram wait;
+  double total_run_us = 0;
+};
+
+struct TaskRunner::PendingTask {
+  Worker* worker;
+  Task task;
+  gint64 posted_us;
+  gint64 deadline_us;
+};
+
+constexpr size_t TaskRunner::kAnyQueue;
+
+TaskRunner::TaskRunner(size_t thread_count)
+    : platform_context_(g_main_context_ref_thread_default()) {
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    std::unique_ptr<Worker> worker(new Worker());
+    worker->context = g_main_context_new();
+    worker->loop = g_main_loop_new(worker->context, FALSE);
+    std::string name = "runner-worker-" + std::to_string(i);
+    worker->thread = g_thread_new(name.c_str(), &TaskRunner::WorkerMain,
+                                  worker.get());
+    workers_.push_back(std::move(worker));
+  }
+}
+
+TaskRunner::~TaskRunner() {
+  Shutdown();
+  g_main_context_unref(platform_context_);
+}
+
+void TaskRunner::Shutdown() {
+  for (const auto& worker : workers_) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      if (worker->stopped) {
+        continue;
+      }
+      worker->stopped = true;
+    }
+    // Quit from inside the worker's loop: g_main_loop_quit() from here would
+    // be lost if the worker has not reached g_main_loop_run() yet. The source
+    // outranks every task, so tasks that have not started are dropped.
+    GSource* source = g_idle_source_new();
+    g_source_set_priority(source, G_MININT);
+    g_source_set_callback(source, &TaskRunner::QuitWorker, worker->loop,
+                          nullptr);
+    g_source_attach(source, worker->context);
+    g_source_unref(source);
+    g_thread_join(worker->thread);
+    worker->thread = nullptr;
+    g_main_loop_unref(worker->loop);
+    worker->loop = nullptr;
+    // Destroys the sources of tasks that never started.
+    g_main_context_unref(worker->context);
+    worker->context = nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(results_mutex_);
+  shut_down_ = true;
+  results_.clear();
+  if (results_source_ != nullptr) {
+    g_source_destroy(results_source_);
+    g_source_unref(results_source_);
+    results_source_ = nullptr;
+  }
+}
+
+bool TaskRunner::PostTask(size_t queue, gint priority, gint64 deadline_us,
+                          Task task) {
+  if (queue == kAnyQueue) {
+    uint64_t fewest = UINT64_MAX;
+    queue = 0;
+    for (size_t i = 0; i < workers_.size(); i++) {
+      Worker* worker = workers_[i].get();
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      uint64_t pending = worker->posted - worker->completed - worker->expired;
+      if (pending < fewest) {
+        fewest = pending;
+        queue = i;
+      }
+    }
+  }
+  g_return_val_if_fail(queue < workers_.size(), FALSE);
+
+  Worker* worker = workers_[queue].get();
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  if (worker->stopped) {
+    return false;
+  }
+  worker->posted++;
+
+  PendingTask* pending =
+      new PendingTask{worker, std::move(task), g_get_monotonic_time(),
+                      deadline_us};
+  // Idle sources run in priority order once nothing more urgent is ready,
+  // which on a worker context means strictly by priority.
+  GSource* source = g_idle_source_new();
+  g_source_set_priority(source, priority);
+  g_source_set_callback(source, &TaskRunner::RunTask, pending,
+                        &TaskRunner::FreeTask);
+  g_source_attach(source, worker->context);
+  g_source_unref(source);
+  return true;
+}
+
+void TaskRunner::PostResult(Task result) {
+  std::lock_guard<std::mutex> lock(results_mutex_);
+  if (shut_down_) {
+    return;
+  }
+  results_.push_back({g_get_monotonic_time(), std::move(result)});
+  if (results_source_ == nullptr) {
+    results_source_ = g_idle_source_new();
+    g_source_set_priority(results_source_, G_PRIORITY_DEFAULT);
+    g_source_set_callback(results_source_, &TaskRunner::DeliverResults, this,
+                          nullptr);
+    g_source_attach(results_source_, platform_context_);
+  }
+}
+
+GMainContext* TaskRunner::GetContext(size_t queue) const {
+  g_return_val_if_fail(queue < workers_.size(), nullptr);
+  return workers_[queue]->context;
+}
+
+TaskRunner::QueueStats TaskRunner::GetQueueStats(size_t queue) const {
+  QueueStats stats;
+  g_return_val_if_fail(queue < workers_.size(), stats);
+  Worker* worker = workers_[queue].get();
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  stats.posted = worker->posted;
+  stats.completed = worker->completed;
+  stats.expired = worker->expired;
+  stats.pending = worker->posted - worker->completed - worker->expired;
+  stats.mean_wait_us = worker->wait.mean_us();
+  stats.p99_wait_us = worker->wait.Percentile(99);
+  stats.max_wait_us = worker->wait.max_us();
+  stats.mean_run_us =
+      worker->completed == 0 ? 0 : worker->total_run_us / worker->completed;
+  return stats;
+}
+
+TaskRunner::ResultStats TaskRunner::GetResultStats() const {
+  std::lock_guard<std::mutex> lock(results_mutex_);
+  ResultStats stats;
+  stats.delivered = result_latency_.count();
+  stats.batches = result_batches_;
+  stats.mean_batch_size =
+      result_batches_ == 0
+          ? 0
+          : static_cast<double>(stats.delivered) / result_batches_;
+  stats.mean_latency_us = result_latency_.mean_us();
+  stats.p99_latency_us = result_latency_.Percentile(99);
+  return stats;
+}
+
+gpointer TaskRunner::WorkerMain(gpointer data) {
+  Worker* worker = static_cast<Worker*>(data);
+  ProfilerScope scope("task-runner");
+  g_main_context_push_thread_default(worker->context);
+  g_main_loop_run(worker->loop);
+  g_main_context_pop_thread_default(worker->context);
+  return nullptr;
+}
+
+gboolean TaskRunner::QuitWorker(gpointer data) {
+  g_main_loop_quit(static_cast<GMainLoop*>(data));
+  return G_SOURCE_REMOVE;
+}
+
+gboolean TaskRunner::RunTask(gpointer data) {
+  PendingTask* pending = static_cast<PendingTask*>(data);
+  Worker* worker = pending->worker;
+  gint64 start_us = g_get_monotonic_time();
+
+  if (pending->deadline_us != 0 && start_us > pending->deadline_us) {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->expired++;
+    return G_SOURCE_REMOVE;
+  }
+
+  pending->task();
+
+  gint64 end_us = g_get_monotonic_time();
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  worker->completed++;
+  worker->wait.Add(start_us - pending->posted_us);
+  worker->total_run_us += end_us - start_us;
+  return G_SOURCE_REMOVE;
+}
+
+void TaskRunner::FreeTask(gpointer data) {
+  delete static_cast<PendingTask*>(data);
+}
+
+gboolean TaskRunner::DeliverResults(gpointer data) {
+  TaskRunner* self = static_cast<TaskRunner*>(data);
+  std::vector<PendingResult> batch;
+  {
+    std::lock_guard<std::mutex> lock(self->results_mutex_);
+    batch.swap(self->results_);
+    g_source_unref(self->results_source_);
+    self->results_source_ = nullptr;
+    self->result_batches_++;
+    gint64 now_us = g_get_monotonic_time();
+    for (const PendingResult& result : batch) {
+      self->result_latency_.Add(now_us - result.posted_us);
+    }
+  }
+
+  for (PendingResult& result : batch) {
+    result.callback();
+  }
+  return G_SOURCE_REMOVE;
+}
@@ -0,0 +1,117 @@
+#ifndef RUNNER_TASK_RUNNER_H_
+#define RUNNER_TASK_RUNNER_H_
+
+#include <glib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "latency_histogram.h"
+
+// A small pool of native worker threads, each running its own GMainContext,
+// so that BLE, storage and analytics work stays off the GTK main context that
+// handles input and rendering.
+//
+// Plugins post tasks to a worker queue with a GLib priority and an optional
+// deadline, and post results back to the platform thread with PostResult().
+// Results are delivered in batches from a single idle source, so a burst of
+// worker output costs the platform thread one main loop iteration.
+class TaskRunner {
+ public:
+  using Task = std::function<void()>;
+
+  // Passed as |queue| to let the runner pick the least busy worker.
+  static constexpr size_t kAnyQueue = static_cast<size_t>(-1);
+
+  struct QueueStats {
+    uint64_t posted = 0;
+    uint64_t completed = 0;
+
+    // Tasks dropped because their deadline passed before they started.
+    uint64_t expired = 0;
+
+    // Tasks posted but not yet started.
+    uint64_t pending = 0;
+
+    // Time from PostTask() until the task starts, in microseconds.
+    double mean_wait_us = 0;
+    double p99_wait_us = 0;
+    double max_wait_us = 0;
+
+    // Time spent running tasks, in microseconds.
+    double mean_run_us = 0;
+  };
+
+  struct ResultStats {
+    uint64_t delivered = 0;
+    uint64_t batches = 0;
+    double mean_batch_size = 0;
+
+    // Time from PostResult() until the result runs on the platform thread,
+    // in microseconds.
+    double mean_latency_us = 0;
+    double p99_latency_us = 0;
+  };
+
+  // Starts |thread_count| workers. Must be called on the platform thread;
+  // results are delivered to the thread-default main context at that time.
+  explicit TaskRunner(size_t thread_count);
+  ~TaskRunner();
+
+  TaskRunner(const TaskRunner&) = delete;
+  TaskRunner& operator=(const TaskRunner&) = delete;
+
+  // Stops every worker, dropping tasks that have not started, and discards
+  // undelivered results. Called automatically on destruction.
+  void Shutdown();
+
+  // Runs |task| on worker |queue| (or kAnyQueue). Among waiting tasks, lower
+  // |priority| values such as G_PRIORITY_HIGH run first. If |deadline_us| is
+  // non-zero and g_get_monotonic_time() has passed it by the time the task
+  // would start, the task is dropped instead. Safe to call from any thread.
+  // Returns false if the runner has been shut down.
+  bool PostTask(size_t queue, gint priority, gint64 deadline_us, Task task);
+
+  // Runs |result| on the platform thread. Safe to call from any thread.
+  void PostResult(Task result);
+
+  size_t queue_count() const { return workers_.size(); }
+
+  // Returns the main context of worker |queue|, so plugins can attach their
+  // own sources (e.g. D-Bus signal watches) to it.
+  GMainContext* GetContext(size_t queue) const;
+
+  QueueStats GetQueueStats(size_t queue) const;
+  ResultStats GetResultStats() const;
+
+ private:
+  struct Worker;
+  struct PendingTask;
+  struct PendingResult {
+    gint64 posted_us;
+    Task callback;
+  };
+
+  static gpointer WorkerMain(gpointer data);
+  static gboolean QuitWorker(gpointer data);
+  static gboolean RunTask(gpointer data);
+  static void FreeTask(gpointer data);
+  static gboolean DeliverResults(gpointer data);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  GMainContext* platform_context_;
+
+  // Guards the fields below.
+  mutable std::mutex results_mutex_;
+  std::vector<PendingResult> results_;
+  GSource* results_source_ = nullptr;
+  bool shut_down_ = false;
+  uint64_t result_batches_ = 0;
+  LatencyHistogram result_latency_;
+};
+
+#endif  // RUNNER_TASK_RUNNER_H_
@@ -0,0 +1,128 @@
+#include "work_stealing_pool.h"
+
+#include <pthread.h>
+
+#include <string>
+
+WorkStealingPool::WorkStealingPool(size_t thread_count) {
+  if (thread_count == 0) {
+    thread_count = std::thread::hardware_concurrency();
+  }
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    threads_.emplace_back(&WorkStealingPool::WorkerMain, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  batch_ready_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkStealingPool::ParallelFor(size_t task_count, const Task& task) {
+  if (task_count == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> batch_lock(batch_mutex_);
+
+  // Hand each worker a contiguous run of tasks. Neighbouring tasks usually
+  // touch neighbouring data, so a worker keeps its locality until it has to
+  // steal.
+  size_t worker_count = workers_.size();
+  for (size_t i = 0; i < worker_count; i++) {
+    size_t begin = task_count * i / worker_count;
+    size_t end = task_count * (i + 1) / worker_count;
+    std::lock_guard<std::mutex> lock(workers_[i]->mutex);
+    for (size_t t = begin; t < end; t++) {
+      workers_[i]->tasks.push_back(t);
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &task;
+  remaining_ = task_count;
+  idle_workers_ = 0;
+  generation_++;
+  batch_ready_.notify_all();
+  batch_done_.wait(lock, [this] {
+    return remaining_ == 0 && idle_workers_ == workers_.size();
+  });
+  task_ = nullptr;
+}
+
+size_t WorkStealingPool::steal_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return steals_;
+}
+
+void WorkStealingPool::WorkerMain(size_t index) {
+  std::string name = "runner-pool-" + std::to_string(index);
+  pthread_setname_np(pthread_self(), name.c_str());
+  size_t seen_generation = 0;
+  while (true) {
+    const Task* task = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      batch_ready_.wait(lock, [this, seen_generation] {
+        return shutting_down_ || generation_ != seen_generation;
+      });
+      if (shutting_down_) {
+        return;
+      }
+      seen_generation = generation_;
+      task = task_;
+    }
+
+    size_t done = 0;
+    size_t next;
+    while (TakeTask(index, &next)) {
+      (*task)(next, index);
+      done++;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    remaining_ -= done;
+    idle_workers_++;
+    if (remaining_ == 0 && idle_workers_ == workers_.size()) {
+      batch_done_.notify_all();
+    }
+  }
+}
+
+bool WorkStealingPool::TakeTask(size_t index, size_t* task) {
+  {
+    Worker* own = workers_[index].get();
+    std::lock_guard<std::mutex> lock(own->mutex);
+    if (!own->tasks.empty()) {
+      *task = own->tasks.front();
+      own->tasks.pop_front();
+      return true;
+    }
+  }
+
+  // Steal from the back of a victim's queue, away from where it is working.
+  size_t worker_count = workers_.size();
+  for (size_t offset = 1; offset < worker_count; offset++) {
+    Worker* victim = workers_[(index + offset) % worker_count].get();
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      *task = victim->tasks.back();
+      victim->tasks.pop_back();
+      std::lock_guard<std::mutex> stats_lock(mutex_);
+      steals_++;
+      return true;
+    }
+  }
+  return false;
+}
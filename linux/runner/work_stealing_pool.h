@@ -0,0 +1,73 @@
+#ifndef RUNNER_WORK_STEALING_POOL_H_
+#define RUNNER_WORK_STEALING_POOL_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that run batches of independent tasks. Each worker
+// starts on its own contiguous share of a batch and steals from the other
+// workers once its share is done, so uneven task costs still keep every core
+// busy.
+class WorkStealingPool {
+ public:
+  // Called with the index of the task to run and the index of the worker
+  // running it. Worker indices are in [0, thread_count()).
+  using Task = std::function<void(size_t task, size_t worker)>;
+
+  // Creates a pool with |thread_count| workers. Zero means one per core.
+  explicit WorkStealingPool(size_t thread_count);
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  // Runs |task| for every index in [0, task_count) and returns once all of
+  // them have finished. Only one batch runs at a time; concurrent callers are
+  // serialized.
+  void ParallelFor(size_t task_count, const Task& task);
+
+  size_t thread_count() const { return workers_.size(); }
+
+  // Number of tasks that were run by a worker other than the one they were
+  // initially assigned to, over the lifetime of the pool.
+  size_t steal_count() const;
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+
+  // Body of each worker thread.
+  void WorkerMain(size_t index);
+
+  // Takes the next task for worker |index|, from its own queue first and then
+  // from the others. Returns false when every queue is empty.
+  bool TakeTask(size_t index, size_t* task);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  // Serializes ParallelFor callers.
+  std::mutex batch_mutex_;
+
+  // Guards the fields below.
+  mutable std::mutex mutex_;
+  std::condition_variable batch_ready_;
+  std::condition_variable batch_done_;
+  const Task* task_ = nullptr;
+  size_t generation_ = 0;
+  size_t remaining_ = 0;
+  size_t idle_workers_ = 0;
+  size_t steals_ = 0;
+  bool shutting_down_ = false;
+};
+
+#endif  // RUNNER_WORK_STEALING_POOL_H_
@@ -0,0 +1,139 @@
+import 'package:flutter_test/flutter_test.dart';
+
+import 'package:my_flutter_app/notification_rate.dart';
+
+void main() {
+  late DateTime now;
+  late NotificationRateController controller;
+
+  setUp(() {
+    now = DateTime(2025, 1, 1);
+    controller = NotificationRateController(now: () => now);
+  });
+
+  void advance(Duration duration) {
+    now = now.add(duration);
+  }
+
+  // The sofa notifies at 4 Hz on its own until the baseline is measured.
+  void measureBaseline() {
+    for (int i = 0; !controller.commandReady; i++) {
+      bool accepted = controller.accept(SensorReading(25.0 + i, 50, 800));
+      controller.recordCpu(Duration(microseconds: accepted ? 100 : 10), accepted: accepted);
+      controller.updateMode();
+      advance(const Duration(milliseconds: 250));
+    }
+  }
+
+  test('decimates to the high rate while visible', () {
+    int accepted = 0;
+    for (int i = 0; i < 40; i++) {
+      if (controller.accept(SensorReading(25.0 + i, 50, 800))) accepted++;
+      advance(const Duration(milliseconds: 250));
+    }
+    // 10 seconds of 4 Hz notifications at a 1 second interval.
+    expect(accepted, 10);
+    expect(controller.mode, NotifyRateMode.high);
+  });
+
+  test('holds the first command until the sofa\'s own rate is measured', () {
+    // Hiding the app changes the mode, but RATE is not sent yet.
+    expect(controller.setVisible(false), isFalse);
+    expect(controller.mode, NotifyRateMode.low);
+
+    int due = 0;
+    for (int i = 0; i <= 40; i++) {
+      expect(controller.commandReady, isFalse);
+      controller.accept(SensorReading(25.0 + i, 50, 800));
+      if (controller.updateMode()) due++;
+      advance(const Duration(milliseconds: 250));
+    }
+    // 40 intervals of 250ms in 10 seconds.
+    expect(controller.commandReady, isTrue);
+    expect(controller.baselinePerMinute, 240);
+    expect(due, 1);
+    expect(controller.command, 'RATE:30000');
+  });
+
+  test('switches to the low rate when hidden', () {
+    measureBaseline();
+    expect(controller.setVisible(false), isTrue);
+    expect(controller.mode, NotifyRateMode.low);
+    expect(controller.command, 'RATE:30000');
+
+    // The last reading accepted at the high rate was at the end of the
+    // baseline, 250ms ago.
+    int accepted = 0;
+    for (int i = 0; i < 61; i++) {
+      if (controller.accept(SensorReading(25.0 + i, 50, 800))) accepted++;
+      advance(const Duration(seconds: 1));
+    }
+    expect(accepted, 2);
+
+    expect(controller.setVisible(true), isTrue);
+    expect(controller.mode, NotifyRateMode.high);
+  });
+
+  test('only passes changes once readings are stable', () {
+    const SensorReading stable = SensorReading(25, 50, 800);
+    for (int i = 0; i < 25; i++) {
+      controller.accept(stable);
+      controller.updateMode();
+      advance(const Duration(seconds: 1));
+    }
+    expect(controller.mode, NotifyRateMode.deltaOnly);
+    expect(controller.command, 'RATE:DELTA');
+
+    expect(controller.accept(stable), isFalse);
+    advance(const Duration(seconds: 1));
+    expect(controller.accept(const SensorReading(25, 50, 900)), isTrue);
+    expect(controller.updateMode(), isTrue);
+    expect(controller.mode, NotifyRateMode.high);
+  });
+
+  test('reports savings against the measured rate when RATE is ignored', () {
+    measureBaseline();
+    controller.setVisible(false);
+    // The sofa keeps sending at 4 Hz until the first minute ends.
+    for (int i = 0; i <= 200; i++) {
+      bool accepted = controller.accept(SensorReading(25.0 + i, 50, 800));
+      controller.recordCpu(Duration(microseconds: accepted ? 100 : 10), accepted: accepted);
+      advance(const Duration(milliseconds: 250));
+    }
+    NotificationRateStats? stats = controller.stats;
+    expect(stats, isNotNull);
+    expect(stats!.baselinePerMinute, 240);
+    expect(stats.receivedPerMinute, 240);
+    // One a second during the baseline (0s..10s), then one at 40s.
+    expect(stats.acceptedPerMinute, 12);
+    // Dropped notifications still cost their decoding: 12 x 100us +
+    // 228 x 10us, against every notification at 100us.
+    expect(stats.cpuPerMinute, const Duration(microseconds: 3480));
+    expect(stats.acceptedCost, const Duration(microseconds: 100));
+    expect(stats.droppedCost, const Duration(microseconds: 10));
+    expect(stats.cpuSaving, closeTo(1 - 3480 / 24000, 1e-9));
+    // 240 notifications of 1.5ms each per minute.
+    expect(stats.radioDutyCycle, closeTo(0.006, 1e-12));
+    // The sofa ignored RATE, so there is no radio saving to claim.
+    expect(stats.radioSaving, closeTo(0, 1e-12));
+  });
+
+  test('reports the radio saving when the sofa honours RATE', () {
+    measureBaseline();
+    controller.setVisible(false);
+    // From 40s the sofa sends every 30 seconds. The first minute, which
+    // includes the baseline, ends at 70s; the second at 130s.
+    now = DateTime(2025, 1, 1).add(const Duration(seconds: 40));
+    for (int i = 0; i < 4; i++) {
+      controller.accept(SensorReading(25.0 + i, 50, 800));
+      controller.recordCpu(const Duration(microseconds: 100), accepted: true);
+      advance(const Duration(seconds: 30));
+    }
+    NotificationRateStats? stats = controller.stats;
+    expect(stats, isNotNull);
+    expect(stats!.receivedPerMinute, 2);
+    expect(stats.radioDutyCycle, closeTo(2 * 1500 / 60e6, 1e-12));
+    expect(stats.radioSaving, closeTo(1 - 2 / 240, 1e-12));
+    expect(stats.cpuSaving, closeTo(1 - 200 / 24000, 1e-9));
+  });
+}
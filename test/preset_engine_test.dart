@@ -0,0 +1,134 @@
+import 'package:flutter_test/flutter_test.dart';
+
+import 'package:my_flutter_app/preset_engine.dart';
+
+void main() {
+  late DateTime now;
+  late PresetEngine engine;
+
+  setUp(() {
+    now = DateTime(2025, 1, 1);
+    engine = PresetEngine(position: 0, now: () => now);
+  });
+
+  void hold(int relay, Duration duration) {
+    engine.startManual(relay);
+    now = now.add(duration);
+    engine.stopManual();
+  }
+
+  test('tracks the position from manual relay presses', () {
+    hold(2, const Duration(seconds: 4));
+    expect(engine.position, closeTo(0.5, 1e-9));
+    hold(1, const Duration(seconds: 2));
+    expect(engine.position, closeTo(0.25, 1e-9));
+    hold(1, const Duration(seconds: 10));
+    expect(engine.position, 0);
+  });
+
+  test('plans a preset as run times for one relay', () {
+    hold(2, const Duration(seconds: 6));
+    engine.save('tv');
+    hold(1, const Duration(seconds: 4));
+
+    MotionPlan plan = engine.planPreset('tv')!;
+    expect(plan.relay1, Duration.zero);
+    expect(plan.relay2, const Duration(seconds: 4));
+    expect(plan.command, 'PLAN:0,4000');
+    expect(plan.estimatedDuration, const Duration(seconds: 4) + PresetEngine.settleTime);
+
+    engine.commit(plan);
+    expect(engine.position, closeTo(0.75, 1e-9));
+    expect(engine.planPreset('tv')!.isEmpty, isTrue);
+    expect(engine.planPreset('tv')!.estimatedDuration, Duration.zero);
+  });
+
+  test('overruns into the end stops', () {
+    hold(2, const Duration(seconds: 2));
+    MotionPlan plan = engine.planTo(0);
+    expect(plan.relay1, const Duration(seconds: 2) + PresetEngine.endStopOverrun);
+    expect(plan.relay2, Duration.zero);
+  });
+
+  test('stores any number of named presets', () {
+    for (int i = 0; i < 20; i++) {
+      hold(2, const Duration(milliseconds: 100));
+      engine.save('preset $i');
+    }
+    expect(engine.names.length, 20);
+    expect(engine.remove('preset 3'), isTrue);
+    expect(engine.planPreset('preset 3'), isNull);
+
+    PresetEngine restored = PresetEngine.fromJson(engine.toJson());
+    expect(restored.names, engine.names);
+    expect(restored.position, engine.position);
+  });
+
+  test('drives to an end stop first when the position is unknown', () {
+    PresetEngine unknown = PresetEngine(now: () => now);
+    expect(unknown.position, isNull);
+    expect(unknown.save('tv'), isFalse);
+
+    // Sit must not unlock the controls while the sofa may still be moving.
+    MotionPlan sit = unknown.planTo(0);
+    expect(sit.relay1, PresetEngine.fullTravel + PresetEngine.endStopOverrun);
+    expect(sit.relay2, Duration.zero);
+    expect(sit.estimatedDuration, greaterThan(PresetEngine.fullTravel));
+
+    MotionPlan lie = unknown.planTo(1);
+    expect(lie.relay1, Duration.zero);
+    expect(lie.relay2, PresetEngine.fullTravel + PresetEngine.endStopOverrun);
+
+    MotionPlan half = unknown.planTo(0.5);
+    expect(half.relay1, PresetEngine.fullTravel + PresetEngine.endStopOverrun);
+    expect(half.relay2, PresetEngine.fullTravel * 0.5);
+
+    unknown.commit(half);
+    expect(unknown.position, 0.5);
+    expect(unknown.save('tv'), isTrue);
+  });
+
+  test('a full-travel hold finds the end stop from an unknown position', () {
+    engine = PresetEngine(now: () => now);
+    hold(2, const Duration(seconds: 3));
+    expect(engine.position, isNull);
+    hold(2, PresetEngine.fullTravel);
+    expect(engine.position, 1);
+  });
+
+  test('saves the position as unknown while a button is held', () {
+    hold(2, const Duration(seconds: 4));
+    engine.startManual(1);
+    expect(PresetEngine.fromJson(engine.toJson()).position, isNull);
+    now = now.add(const Duration(seconds: 2));
+    engine.stopManual();
+    expect(PresetEngine.fromJson(engine.toJson()).position, closeTo(0.25, 1e-9));
+  });
+
+  test('forgets the position after a movement it cannot compute', () {
+    hold(2, const Duration(seconds: 4));
+    engine.startManual(1);
+    now = now.add(const Duration(seconds: 1));
+    engine.forgetPosition(moving: PresetEngine.fullTravel);
+    expect(engine.position, isNull);
+    expect(engine.remainingMotion, PresetEngine.fullTravel);
+
+    // The dropped hold does not move the position on release.
+    now = now.add(const Duration(seconds: 1));
+    engine.stopManual();
+    expect(engine.position, isNull);
+    expect(engine.planTo(0).relay1, PresetEngine.fullTravel + PresetEngine.endStopOverrun);
+    expect(PresetEngine.fromJson(engine.toJson()).position, isNull);
+  });
+
+  test('restores the time left on a committed plan', () {
+    MotionPlan plan = engine.planTo(1);
+    engine.commit(plan);
+    now = now.add(const Duration(seconds: 2));
+
+    PresetEngine restored = PresetEngine.fromJson(engine.toJson(), now: () => now);
+    expect(restored.remainingMotion, plan.estimatedDuration - const Duration(seconds: 2));
+    now = now.add(plan.estimatedDuration);
+    expect(restored.remainingMotion, Duration.zero);
+  });
+}
@@ -0,0 +1,46 @@
+import 'dart:io';
+
+import 'package:flutter_test/flutter_test.dart';
+
+import 'package:my_flutter_app/preset_engine.dart';
+import 'package:my_flutter_app/preset_store.dart';
+
+void main() {
+  late Directory directory;
+  late PresetStore store;
+
+  setUp(() {
+    directory = Directory.systemTemp.createTempSync('preset_store_test');
+    store = PresetStore(File('${directory.path}/presets.json'));
+  });
+
+  tearDown(() {
+    directory.deleteSync(recursive: true);
+  });
+
+  test('starts empty at an unknown position without a file', () async {
+    PresetEngine engine = await store.load();
+    expect(engine.names, isEmpty);
+    expect(engine.position, isNull);
+  });
+
+  test('keeps presets and the position across restarts', () async {
+    PresetEngine engine = PresetEngine(position: 0);
+    engine.commit(engine.planTo(0.6));
+    engine.save('tv');
+    engine.commit(engine.planTo(0.2));
+    await store.save(engine);
+
+    PresetEngine restored = await store.load();
+    expect(restored.names, ['tv']);
+    expect(restored.presetPosition('tv'), closeTo(0.6, 1e-9));
+    expect(restored.position, closeTo(0.2, 1e-9));
+  });
+
+  test('falls back to an empty engine on a corrupt file', () async {
+    store.file.writeAsStringSync('{"presets": ');
+    PresetEngine engine = await store.load();
+    expect(engine.names, isEmpty);
+    expect(engine.position, isNull);
+  });
+}
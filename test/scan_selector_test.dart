@@ -0,0 +1,65 @@
+import 'package:flutter_test/flutter_test.dart';
+
+import 'package:my_flutter_app/scan_selector.dart';
+
+void main() {
+  late DateTime now;
+  late ScanSelector<String> selector;
+
+  setUp(() {
+    now = DateTime(2025, 1, 1);
+    selector = ScanSelector<String>();
+  });
+
+  // Reports [id] at [rssi] 150 ms after the previous report.
+  bool report(String id, int rssi) {
+    now = now.add(const Duration(milliseconds: 150));
+    return selector.add(id, rssi, now);
+  }
+
+  test('picks the near sofa even when the neighbour is seen first and spikes', () {
+    // The neighbour's sofa is heard first, and its third report beats the near
+    // sofa's dip; picking by raw RSSI at three sightings would connect to it.
+    const List<int> near = [-58, -75, -60, -59, -61, -60];
+    const List<int> far = [-72, -70, -62, -74, -71, -73];
+    String? selected;
+    for (int i = 0; i < near.length && selected == null; i++) {
+      if (report('neighbour', far[i])) selected = 'neighbour';
+      if (report('near', near[i])) selected = 'near';
+    }
+    expect(selected, 'near');
+    expect(selector.best, 'near');
+  });
+
+  test('does not select while two sofas are within the margin', () {
+    for (int i = 0; i < 20; i++) {
+      expect(report('a', -60), isFalse);
+      expect(report('b', -63), isFalse);
+    }
+    expect(selector.hasSelection, isFalse);
+    // The scan timeout falls back to the strongest.
+    expect(selector.best, 'a');
+  });
+
+  test('selects a lone sofa after enough sightings', () {
+    expect(report('sofa', -80), isFalse);
+    expect(report('sofa', -80), isFalse);
+    expect(report('sofa', -80), isTrue);
+    expect(selector.best, 'sofa');
+  });
+
+  test('drops repeated reports and weak signals', () {
+    expect(selector.add('sofa', -60, now), isFalse);
+    // flutter_blue_plus re-delivers the same result in later batches.
+    expect(selector.add('sofa', -60, now), isFalse);
+    expect(selector.add('sofa', -60, now.add(const Duration(milliseconds: 50))), isFalse);
+    expect(report('sofa', -60), isFalse);
+    expect(report('sofa', -60), isTrue);
+
+    ScanSelector<String> weak = ScanSelector<String>();
+    for (int i = 0; i < 5; i++) {
+      expect(weak.add('far', -99, now.add(Duration(seconds: i))), isFalse);
+    }
+    expect(weak.best, isNull);
+  });
+}